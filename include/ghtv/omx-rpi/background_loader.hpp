@@ -0,0 +1,402 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_BACKGROUND_LOADER_HPP
+#define GHTV_OMX_RPI_BACKGROUND_LOADER_HPP
+
+#include <ghtv/omx-rpi/image_pipeline.hpp>
+#include <ghtv/omx-rpi/load_admission.hpp>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GLES2/gl2.h>
+
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/function.hpp>
+#include <boost/bind.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <stdexcept>
+
+namespace ghtv { namespace omx_rpi {
+
+// A texture filled on the background context. It may be bound on
+// another context of the share group once its fence is signaled.
+struct published_texture
+{
+  GLuint texture;
+  EGLSyncKHR sync;
+
+  // Returns true when the GPU finished filling the texture,
+  // timeout is in nanoseconds
+  bool ready(EGLDisplay display, EGLTimeKHR timeout = 0) const
+  {
+    if(sync == EGL_NO_SYNC_KHR)
+      return true;
+    return eglClientWaitSyncKHR(display, sync, 0, timeout) == EGL_CONDITION_SATISFIED_KHR;
+  }
+
+  // Destroys the fence, the texture belongs to the caller
+  void release_sync(EGLDisplay display)
+  {
+    if(sync != EGL_NO_SYNC_KHR)
+      eglDestroySyncKHR(display, sync);
+    sync = EGL_NO_SYNC_KHR;
+  }
+};
+
+// Owns an image_pipeline and a thread with its own EGL context in
+// the caller's share group. Textures are created and filled there, so
+// the render thread never calls into the pipeline nor waits for it.
+// Images hinted with prefetch are decoded while there is nothing to
+// load, up to prefetch_capacity of them are kept in memory. A load of
+// another file stops the decode of a hint, which is hinted again; a
+// load of the hinted file takes the decoded image. Each
+// decode first waits for admission, whose budget it shares with the
+// other loaders of the process, unless given its own.
+struct background_loader : boost::noncopyable
+{
+  typedef boost::function<void(bool, published_texture)> callback_type;
+
+  background_loader(EGLDisplay display, EGLContext share_context, EGLConfig config
+                    , std::size_t prefetch_capacity = 2u
+                    , load_admission& admission = load_admission::instance())
+    : display(display), share_context(share_context), config(config)
+    , context(EGL_NO_CONTEXT), surface(EGL_NO_SURFACE)
+    , prefetch_capacity(prefetch_capacity), admission(admission)
+    , hint_decoding(false), hint_stopped(false)
+    , started(false), stopping(false), failed(false)
+  {
+    thread = boost::thread(boost::bind(&background_loader::run, this));
+
+    boost::unique_lock<boost::mutex> l(mutex);
+    while(!started)
+      condition.wait(l);
+    if(failed)
+    {
+      l.unlock();
+      thread.join();
+      throw std::runtime_error("Couldn't create the background EGL context");
+    }
+  }
+
+  // Loads not started yet fail, their callbacks are called here
+  // before waiting for the one in progress. A hint being decoded is
+  // stopped
+  ~background_loader()
+  {
+    std::deque<job> cancelled;
+    bool stop_hint;
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      stopping = true;
+      cancelled.swap(jobs);
+      stop_hint = hint_decoding;
+      condition.notify_all();
+    }
+    if(stop_hint)
+      pipeline.stop_load();
+    published_texture none = {0u, EGL_NO_SYNC_KHR};
+    for(std::deque<job>::iterator first = cancelled.begin(); first != cancelled.end(); ++first)
+      first->callback(false, none);
+    thread.join();
+  }
+
+  // f(success, texture) is called on the background thread, or by
+  // the destructor if the load didn't start. On failure no texture is
+  // kept.
+  template <typename F>
+  void load(std::string const& file, F f)
+  {
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      job j = {file, f};
+      jobs.push_back(j);
+      // The load decodes it, if it wasn't yet
+      for(std::deque<hint>::iterator first = hints.begin(); first != hints.end(); ++first)
+        if(first->file == file)
+        {
+          hints.erase(first);
+          break;
+        }
+      condition.notify_all();
+      // A hint of the same file being decoded is the load's image
+      if(!hint_decoding || hint_in_flight.file == file || hint_stopped)
+        return;
+      hint_stopped = true;
+    }
+    pipeline.stop_load();
+  }
+
+  // Hints that file is about to be loaded. Its input is read ahead
+  // right away. Once nothing is left to load, the hint with the
+  // highest priority is decoded and kept until a load of the same
+  // file takes it; hints beyond prefetch_capacity drop the least
+  // urgent one, and decoded images beyond it the oldest one.
+  void prefetch(std::string const& file, int priority = 0)
+  {
+    read_ahead(file);
+    if(!prefetch_capacity)
+      return;
+
+    boost::unique_lock<boost::mutex> l(mutex);
+    if(find_prefetched(file) != prefetched.end()
+       || (hint_decoding && hint_in_flight.file == file))
+      return;
+    for(std::deque<job>::const_iterator j = jobs.begin(); j != jobs.end(); ++j)
+      if(j->file == file)
+        return;
+    std::deque<hint>::iterator first = hints.begin(), least = hints.begin();
+    for(;first != hints.end() && first->file != file; ++first)
+      if(first->priority < least->priority)
+        least = first;
+    if(first != hints.end())
+      first->priority = (std::max)(first->priority, priority);
+    else
+    {
+      if(hints.size() == prefetch_capacity && least != hints.end())
+      {
+        if(least->priority > priority)
+          return;
+        hints.erase(least);
+      }
+      hint h = {file, priority};
+      hints.push_back(h);
+    }
+    condition.notify_all();
+  }
+
+  std::size_t pending() const
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    return jobs.size();
+  }
+
+  image_pipeline pipeline;
+private:
+  struct job
+  {
+    std::string file;
+    callback_type callback;
+  };
+
+  struct hint
+  {
+    std::string file;
+    int priority;
+  };
+
+  struct prefetched_image
+  {
+    std::string file;
+    decoded_image image;
+  };
+
+  // Already locked
+  std::deque<prefetched_image>::iterator find_prefetched(std::string const& file)
+  {
+    std::deque<prefetched_image>::iterator first = prefetched.begin();
+    while(first != prefetched.end() && first->file != file)
+      ++first;
+    return first;
+  }
+
+  // Already locked. Hints h again after a load stopped its decode,
+  // unless that took its place
+  void rehint(hint const& h)
+  {
+    if(hints.size() == prefetch_capacity)
+      return;
+    for(std::deque<job>::const_iterator j = jobs.begin(); j != jobs.end(); ++j)
+      if(j->file == h.file)
+        return;
+    for(std::deque<hint>::const_iterator first = hints.begin(); first != hints.end(); ++first)
+      if(first->file == h.file)
+        return;
+    hints.push_back(h);
+  }
+
+  // Runs while there is nothing to load, h is hint_in_flight. A load
+  // arriving meanwhile stops it
+  void decode_hint(hint const& h)
+  {
+    decoded_image image;
+    load_admission::reservation reservation(admission, estimate_load_cost(h.file));
+    {
+      // A load may have come while waiting for admission
+      boost::unique_lock<boost::mutex> l(mutex);
+      if(!jobs.empty() || stopping)
+      {
+        hint_decoding = false;
+        rehint(h);
+        return;
+      }
+    }
+
+    image_pipeline::load_completion completion;
+    pipeline.load_image(h.file, image, boost::bind(&image_pipeline::load_completion::signal, &completion, _1));
+    {
+      // Stopped before the load started, it wasn't
+      boost::unique_lock<boost::mutex> l(mutex);
+      if(hint_stopped || stopping)
+      {
+        l.unlock();
+        pipeline.stop_load();
+      }
+    }
+    bool success = completion.wait();
+    pipeline.reset();
+
+    boost::unique_lock<boost::mutex> l(mutex);
+    hint_decoding = false;
+    if(!success)
+    {
+      if(hint_stopped && !stopping)
+        rehint(h);
+      return;
+    }
+    if(prefetched.size() == prefetch_capacity)
+      prefetched.pop_front();
+    prefetched.push_back(prefetched_image());
+    prefetched.back().file = h.file;
+    prefetched.back().image.swap(image);
+  }
+
+  bool make_current()
+  {
+    EGLint context_attributes[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+    context = eglCreateContext(display, config, share_context, context_attributes);
+    if(context == EGL_NO_CONTEXT)
+      return false;
+
+    // A context can't be current without a surface unless
+    // EGL_KHR_surfaceless_context is supported
+    EGLint surface_attributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    surface = eglCreatePbufferSurface(display, config, surface_attributes);
+    return eglMakeCurrent(display, surface, surface, context) == EGL_TRUE;
+  }
+
+  void run()
+  {
+    bool current = make_current();
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      started = true;
+      failed = !current;
+      condition.notify_all();
+    }
+
+    while(current)
+    {
+      job j;
+      decoded_image image;
+      bool found = false;
+      {
+        boost::unique_lock<boost::mutex> l(mutex);
+        while(jobs.empty() && hints.empty() && !stopping)
+          condition.wait(l);
+        if(stopping)
+          break;
+        if(jobs.empty())
+        {
+          std::deque<hint>::iterator first = hints.begin(), most = hints.begin();
+          for(; first != hints.end(); ++first)
+            if(first->priority > most->priority)
+              most = first;
+          hint_in_flight = *most;
+          hint_decoding = true;
+          hint_stopped = false;
+          hints.erase(most);
+          l.unlock();
+          decode_hint(hint_in_flight);
+          continue;
+        }
+        j = jobs.front();
+        jobs.pop_front();
+
+        std::deque<prefetched_image>::iterator p = find_prefetched(j.file);
+        if(p != prefetched.end())
+        {
+          found = true;
+          image.swap(p->image);
+          prefetched.erase(p);
+        }
+      }
+
+      published_texture published = {0u, EGL_NO_SYNC_KHR};
+      glGenTextures(1, &published.texture);
+
+      bool success = found;
+      if(found)
+        upload_texture(published.texture, image);
+      else
+      {
+        load_admission::reservation reservation(admission, estimate_load_cost(j.file));
+        image_pipeline::load_completion completion;
+        pipeline.load_image(j.file, published.texture, &display, &context
+                            , boost::bind(&image_pipeline::load_completion::signal, &completion, _1));
+        success = completion.wait();
+        pipeline.reset();
+      }
+
+      if(success)
+      {
+        published.sync = eglCreateSyncKHR(display, EGL_SYNC_FENCE_KHR, NULL);
+        glFlush();
+      }
+      else
+      {
+        glDeleteTextures(1, &published.texture);
+        published.texture = 0u;
+      }
+      j.callback(success, published);
+    }
+
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if(surface != EGL_NO_SURFACE)
+      eglDestroySurface(display, surface);
+    if(context != EGL_NO_CONTEXT)
+      eglDestroyContext(display, context);
+  }
+
+  EGLDisplay display;
+  EGLContext share_context;
+  EGLConfig config;
+  EGLContext context;
+  EGLSurface surface;
+  std::size_t prefetch_capacity;
+  load_admission& admission;
+
+  mutable boost::mutex mutex;
+  boost::condition_variable condition;
+  std::deque<job> jobs;
+  std::deque<hint> hints;
+  std::deque<prefetched_image> prefetched;
+  // Only the loader thread changes hint_in_flight
+  hint hint_in_flight;
+  bool hint_decoding, hint_stopped;
+  bool started, stopping, failed;
+  boost::thread thread;
+};
+
+} }
+
+#endif
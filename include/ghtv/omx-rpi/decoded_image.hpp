@@ -0,0 +1,274 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_DECODED_IMAGE_HPP
+#define GHTV_OMX_RPI_DECODED_IMAGE_HPP
+
+#include <GLES2/gl2.h>
+
+#include <boost/cstdint.hpp>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstring>
+
+#ifndef GL_ETC1_RGB8_OES
+#define GL_ETC1_RGB8_OES 0x8D64
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ghtv { namespace omx_rpi {
+
+// Pixels decoded to main memory by the pipeline's CPU output path,
+// laid out as glTexImage2D expects them: rows top to bottom, stride
+// bytes apart.
+struct decoded_image
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+  GLenum format;
+  GLenum type;
+  std::vector<unsigned char> pixels;
+
+  decoded_image()
+    : width(0u), height(0u), stride(0u), format(GL_RGBA), type(GL_UNSIGNED_BYTE)
+  {}
+
+  unsigned char* row(unsigned int y)
+  {
+    return &pixels[y*stride];
+  }
+  unsigned char const* row(unsigned int y) const
+  {
+    return &pixels[y*stride];
+  }
+
+  // Hands the pixels over without copying them
+  void swap(decoded_image& other)
+  {
+    std::swap(width, other.width);
+    std::swap(height, other.height);
+    std::swap(stride, other.stride);
+    std::swap(format, other.format);
+    std::swap(type, other.type);
+    pixels.swap(other.pixels);
+  }
+};
+
+// Identifies the content of a source file, so anything derived from it
+// can be checked for staleness. mtime is in nanoseconds. hash covers
+// the whole content, computed only when hashed is set.
+struct source_stamp
+{
+  boost::uint64_t size;
+  boost::int64_t mtime;
+  boost::uint64_t inode;
+  boost::uint64_t hash;
+  bool hashed;
+};
+
+inline bool operator==(source_stamp const& lhs, source_stamp const& rhs)
+{
+  return lhs.size == rhs.size && lhs.mtime == rhs.mtime && lhs.inode == rhs.inode
+    && lhs.hash == rhs.hash;
+}
+
+inline bool operator!=(source_stamp const& lhs, source_stamp const& rhs)
+{
+  return !(lhs == rhs);
+}
+
+namespace detail {
+
+boost::uint64_t const fnv1a_offset_basis = 0xcbf29ce484222325ull;
+
+inline boost::uint64_t fnv1a(void const* data, std::size_t size
+                             , boost::uint64_t hash = fnv1a_offset_basis)
+{
+  unsigned char const* first = static_cast<unsigned char const*>(data);
+  for(unsigned char const* last = first + size; first != last; ++first)
+  {
+    hash ^= *first;
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+inline boost::uint64_t fnv1a(std::string const& s)
+{
+  return fnv1a(s.data(), s.size());
+}
+
+inline unsigned char clamp_byte(int v)
+{
+  return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// BT.601 full range, as JFIF defines it for JPEG, 16.16 fixed point
+inline void yuv_to_rgba(int y, int u, int v, unsigned char* rgba)
+{
+  int c = y << 16, d = u - 128, e = v - 128;
+  rgba[0] = clamp_byte((c + 91881 * e + 32768) >> 16);
+  rgba[1] = clamp_byte((c - 22554 * d - 46802 * e + 32768) >> 16);
+  rgba[2] = clamp_byte((c + 116130 * d + 32768) >> 16);
+  rgba[3] = 255;
+}
+
+// Converts one slice of OMX_COLOR_FormatYUV420PackedPlanar as output by
+// image_decode: a Y plane of slice_height rows followed by U and V
+// planes at half resolution, all sharing the slice layout.
+inline void yuv420_slice_to_rgba(unsigned char const* slice, unsigned int in_stride
+                                 , unsigned int slice_height
+                                 , unsigned int width, unsigned int rows
+                                 , unsigned char* out, unsigned int out_stride)
+{
+  unsigned char const* y_plane = slice;
+  unsigned char const* u_plane = y_plane + in_stride * slice_height;
+  unsigned char const* v_plane = u_plane + (in_stride/2) * (slice_height/2);
+  for(unsigned int row = 0; row != rows; ++row)
+  {
+    unsigned char const* y = y_plane + row * in_stride;
+    unsigned char const* u = u_plane + (row/2) * (in_stride/2);
+    unsigned char const* v = v_plane + (row/2) * (in_stride/2);
+    unsigned char* rgba = out + row * out_stride;
+    for(unsigned int x = 0; x != width; ++x, rgba += 4)
+      yuv_to_rgba(y[x], u[x/2], v[x/2], rgba);
+  }
+}
+
+inline void copy_rows(unsigned char const* in, unsigned int in_stride
+                      , unsigned int row_size, unsigned int rows
+                      , unsigned char* out, unsigned int out_stride)
+{
+  if(!rows)
+    return;
+  if(in_stride == out_stride)
+    std::memcpy(out, in, row_size + (rows - 1) * out_stride);
+  else
+    for(unsigned int row = 0; row != rows; ++row)
+      std::memcpy(out + row * out_stride, in + row * in_stride, row_size);
+}
+
+}
+
+// Bytes of pixels as decoded_image lays them out, rows of 4x4 blocks
+// for ETC1
+inline boost::uint64_t texture_data_size(unsigned int height, unsigned int stride, GLenum format)
+{
+  unsigned int rows = format == GL_ETC1_RGB8_OES ? (height + 3u) / 4u : height;
+  return boost::uint64_t(stride) * rows;
+}
+
+// Uploads pixels as decoded_image lays them out, compressed formats
+// with glCompressedTexImage2D. Must be called with a current EGL
+// context
+inline void upload_texture(GLuint texture_id, unsigned int width, unsigned int height
+                           , unsigned int stride, GLenum format, GLenum type
+                           , void const* pixels, std::size_t size)
+{
+  glBindTexture (GL_TEXTURE_2D, texture_id);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  if(format == GL_ETC1_RGB8_OES)
+    glCompressedTexImage2D (GL_TEXTURE_2D, 0, format, width, height, 0, size, pixels);
+  else
+  {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, stride % 8 == 0 ? 8 : stride % 4 == 0 ? 4 : 1);
+    glTexImage2D (GL_TEXTURE_2D, 0, format, width, height, 0, format, type, pixels);
+  }
+}
+
+inline void upload_texture(GLuint texture_id, decoded_image const& image)
+{
+  upload_texture(texture_id, image.width, image.height, image.stride, image.format, image.type
+                 , image.pixels.empty() ? 0 : &image.pixels[0], image.pixels.size());
+}
+
+namespace detail {
+
+inline void stamp_stat(struct stat const& st, source_stamp& stamp)
+{
+  stamp.size = st.st_size;
+  stamp.mtime = boost::int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  stamp.inode = st.st_ino;
+  stamp.hash = fnv1a_offset_basis;
+  stamp.hashed = false;
+}
+
+}
+
+// Hashes the content of the file at path into stamp
+inline bool hash_source(std::string const& path, source_stamp& stamp)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+
+  stamp.hash = detail::fnv1a_offset_basis;
+  unsigned char buffer[16384];
+  ssize_t read;
+  while((read = ::read(fd, buffer, sizeof(buffer))) > 0)
+    stamp.hash = detail::fnv1a(buffer, read, stamp.hash);
+  ::close(fd);
+  stamp.hashed = read == 0;
+  return stamp.hashed;
+}
+
+// Fills stamp from the file at path, reading its content only if hash
+// is set. Lookups don't, see same_source; entries are stored hashed.
+inline bool make_source_stamp(std::string const& path, source_stamp& stamp, bool hash = false)
+{
+  struct stat st;
+  if(::stat(path.c_str(), &st) != 0)
+    return false;
+  detail::stamp_stat(st, stamp);
+  return !hash || hash_source(path, stamp);
+}
+
+// Whether stored, the hashed stamp of the source an entry was made
+// from, still describes path, whose current stamp is stamp. Size,
+// mtime and inode decide; the content is only hashed, into stamp, when
+// the file was touched or replaced by one of the same size.
+inline bool same_source(source_stamp const& stored, source_stamp& stamp, std::string const& path)
+{
+  if(stored.size != stamp.size)
+    return false;
+  if(stored.mtime == stamp.mtime && stored.inode == stamp.inode)
+    return true;
+  return (stamp.hashed || hash_source(path, stamp)) && stored.hash == stamp.hash;
+}
+
+// Asks the kernel to start reading path into the page cache, without
+// waiting for it. Returns false if path can't be opened
+inline bool read_ahead(std::string const& path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  ::close(fd);
+  return true;
+}
+
+} }
+
+#endif
@@ -0,0 +1,260 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_DECODED_IMAGE_CACHE_HPP
+#define GHTV_OMX_RPI_DECODED_IMAGE_CACHE_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ghtv { namespace omx_rpi {
+
+// On-disk layout of a cache entry. The pixels start at data_offset,
+// which is page aligned so a mapping of the file can be handed
+// directly to glTexImage2D.
+struct decoded_image_cache_header
+{
+  char magic[8];
+  boost::uint32_t version;
+  boost::uint32_t width;
+  boost::uint32_t height;
+  boost::uint32_t stride;
+  boost::uint32_t format;
+  boost::uint32_t type;
+  boost::uint32_t unpack_alignment;
+  boost::uint32_t reserved;
+  boost::uint64_t source_size;
+  boost::int64_t source_mtime;
+  boost::uint64_t source_hash;
+  boost::uint64_t source_inode;
+  boost::uint64_t data_offset;
+  boost::uint64_t data_size;
+};
+
+// A read-only mapping of one cache entry
+struct mapped_image : boost::noncopyable
+{
+  mapped_image(void* base, std::size_t length)
+    : base(base), length(length)
+  {}
+  ~mapped_image()
+  {
+    ::munmap(base, length);
+  }
+
+  decoded_image_cache_header const& header() const
+  {
+    return *static_cast<decoded_image_cache_header const*>(base);
+  }
+  unsigned int width() const { return header().width; }
+  unsigned int height() const { return header().height; }
+  unsigned int stride() const { return header().stride; }
+  unsigned char const* pixels() const
+  {
+    return static_cast<unsigned char const*>(base) + header().data_offset;
+  }
+
+  // Must be called with a current EGL context
+  void upload(GLuint texture_id) const
+  {
+    upload_texture(texture_id, width(), height(), stride(), header().format, header().type
+                   , pixels(), header().data_size);
+  }
+
+  void copy_to(decoded_image& image) const
+  {
+    image.width = width();
+    image.height = height();
+    image.stride = stride();
+    image.format = header().format;
+    image.type = header().type;
+    image.pixels.assign(pixels(), pixels() + header().data_size);
+  }
+
+  void* base;
+  std::size_t length;
+};
+
+// A directory of decoded images, one file per source, named after a
+// hash of the source path. Entries are validated against the source
+// size, mtime and inode on lookup, and against its content hash when
+// these differ.
+struct decoded_image_cache
+{
+  static boost::uint32_t const version = 2u;
+
+  decoded_image_cache(std::string const& directory)
+    : directory(directory)
+  {
+    ::mkdir(directory.c_str(), 0755);
+  }
+
+  boost::shared_ptr<mapped_image> find(std::string const& source) const
+  {
+    source_stamp stamp;
+    if(!make_source_stamp(source, stamp))
+      return boost::shared_ptr<mapped_image>();
+    return find(source, stamp);
+  }
+
+  boost::shared_ptr<mapped_image> find(std::string const& source, source_stamp& stamp) const
+  {
+    return find(source, stamp, source);
+  }
+
+  // key names the entry, a variant of source or source itself. stamp
+  // gets the source's hash if it had to be checked
+  boost::shared_ptr<mapped_image> find(std::string const& key, source_stamp& stamp
+                                       , std::string const& source) const
+  {
+    boost::shared_ptr<mapped_image> r;
+    int fd = ::open(entry_path(key).c_str(), O_RDONLY);
+    if(fd < 0)
+      return r;
+
+    struct stat st;
+    if(::fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(decoded_image_cache_header))
+    {
+      void* base = ::mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(base != MAP_FAILED)
+      {
+        r.reset(new mapped_image(base, st.st_size));
+        decoded_image_cache_header const& h = r->header();
+        source_stamp stored = {h.source_size, h.source_mtime, h.source_inode, h.source_hash, true};
+        if(std::memcmp(h.magic, magic(), sizeof(h.magic))
+           || h.version != version
+           || h.data_offset + h.data_size > (boost::uint64_t)st.st_size
+           // Less than the rows uploading reads
+           || h.data_size < texture_data_size(h.height, h.stride, h.format)
+           || !same_source(stored, stamp, source))
+          r.reset();
+      }
+    }
+    ::close(fd);
+    return r;
+  }
+
+  bool store(std::string const& source, decoded_image const& image) const
+  {
+    source_stamp stamp;
+    if(!make_source_stamp(source, stamp, true))
+      return false;
+    return store(source, stamp, image);
+  }
+
+  // Writes to a temporary file of its own and renames it over the
+  // entry, so concurrent readers never map a partially written entry
+  // and concurrent writers don't write into each other's. stamp must be
+  // hashed
+  bool store(std::string const& source, source_stamp const& stamp, decoded_image const& image) const
+  {
+    assert(stamp.hashed);
+    decoded_image_cache_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, magic(), sizeof(h.magic));
+    h.version = version;
+    h.width = image.width;
+    h.height = image.height;
+    h.stride = image.stride;
+    h.format = image.format;
+    h.type = image.type;
+    h.unpack_alignment = image.stride % 8 == 0 ? 8 : image.stride % 4 == 0 ? 4 : 1;
+    h.source_size = stamp.size;
+    h.source_mtime = stamp.mtime;
+    h.source_hash = stamp.hash;
+    h.source_inode = stamp.inode;
+    h.data_offset = page_size();
+    h.data_size = image.pixels.size();
+
+    std::string path = entry_path(source), pattern = directory + "/tmp.XXXXXX";
+    std::vector<char> tmp_path(pattern.begin(), pattern.end());
+    tmp_path.push_back('\0');
+    int fd = ::mkstemp(&tmp_path[0]);
+    if(fd < 0)
+      return false;
+
+    // mkstemp leaves it readable by the owner only
+    bool ok = ::fchmod(fd, 0644) == 0
+      && write_all(fd, &h, sizeof(h))
+      && ::lseek(fd, h.data_offset, SEEK_SET) == (off_t)h.data_offset
+      && (image.pixels.empty() || write_all(fd, &image.pixels[0], image.pixels.size()));
+    ok = ::close(fd) == 0 && ok;
+    if(ok)
+      ok = std::rename(&tmp_path[0], path.c_str()) == 0;
+    if(!ok)
+      ::unlink(&tmp_path[0]);
+    return ok;
+  }
+
+  void erase(std::string const& source) const
+  {
+    ::unlink(entry_path(source).c_str());
+  }
+
+  std::string entry_path(std::string const& source) const
+  {
+    char name[32];
+    std::sprintf(name, "/%016llx.raw", (unsigned long long)detail::fnv1a(source));
+    return directory + name;
+  }
+
+  std::string directory;
+private:
+  static char const* magic() { return "GHTVDIC"; }
+  static std::size_t page_size()
+  {
+    long size = ::sysconf(_SC_PAGESIZE);
+    return size > 0 ? size : 4096;
+  }
+  static bool write_all(int fd, void const* data, std::size_t size)
+  {
+    char const* p = static_cast<char const*>(data);
+    while(size)
+    {
+      ssize_t written = ::write(fd, p, size);
+      if(written < 0 && errno == EINTR)
+        continue;
+      if(written <= 0)
+        return false;
+      p += written;
+      size -= written;
+    }
+    return true;
+  }
+};
+
+} }
+
+#endif
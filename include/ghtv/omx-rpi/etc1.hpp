@@ -0,0 +1,248 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_ETC1_HPP
+#define GHTV_OMX_RPI_ETC1_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+namespace detail {
+
+int const etc1_modifiers[8][4] =
+  {
+    {2, 8, -2, -8}, {5, 17, -5, -17}, {9, 29, -9, -29}, {13, 42, -13, -42}
+    , {18, 60, -18, -60}, {24, 80, -24, -80}, {33, 106, -33, -106}, {47, 183, -47, -183}
+  };
+
+struct etc1_subblock
+{
+  int base[3];
+  unsigned int table;
+  unsigned int indices[8];
+  int error;
+};
+
+// Picks the modifier table and per pixel modifiers for eight pixels
+// around base. A modifier m changes every channel alike, so without
+// clamping the error of a pixel is sum(d^2) + 2m*sum(d) + 3m^2, with
+// d = base - pixel: only sum(d) takes part in the choice. The loops
+// are over fixed size arrays so the compiler can vectorize them.
+inline void etc1_fit_subblock(unsigned char const* const* pixels, etc1_subblock& s)
+{
+  int sum_d[8], constant = 0;
+  for(int i = 0; i != 8; ++i)
+  {
+    int dr = s.base[0] - pixels[i][0], dg = s.base[1] - pixels[i][1], db = s.base[2] - pixels[i][2];
+    sum_d[i] = dr + dg + db;
+    constant += dr*dr + dg*dg + db*db;
+  }
+
+  s.error = -1;
+  s.table = 0u;
+  for(unsigned int table = 0; table != 8u; ++table)
+  {
+    int error = constant;
+    unsigned int indices[8];
+    for(int i = 0; i != 8; ++i)
+    {
+      int best = 0, best_error = 0;
+      for(int m = 0; m != 4; ++m)
+      {
+        int modifier = etc1_modifiers[table][m]
+          , e = 2*modifier*sum_d[i] + 3*modifier*modifier;
+        if(m == 0 || e < best_error)
+        {
+          best = m;
+          best_error = e;
+        }
+      }
+      indices[i] = best;
+      error += best_error;
+    }
+    if(s.error < 0 || error < s.error)
+    {
+      s.error = error;
+      s.table = table;
+      std::copy(indices, indices + 8, s.indices);
+    }
+  }
+}
+
+inline int etc1_expand4(int c) { return (c << 4) | c; }
+inline int etc1_expand5(int c) { return (c << 3) | (c >> 2); }
+inline int etc1_quantize4(int v) { return (v * 15 + 127) / 255; }
+inline int etc1_quantize5(int v) { return (v * 31 + 127) / 255; }
+
+// block is 16 RGBA pixels in row order
+inline boost::uint64_t etc1_encode_block(unsigned char const* block)
+{
+  boost::uint64_t best_bits = 0u;
+  int best_error = -1;
+
+  for(int flip = 0; flip != 2; ++flip)
+  {
+    // Pixels of each subblock, and their coordinates for the indices
+    unsigned char const* pixels[2][8];
+    unsigned int positions[2][8];
+    int average[2][3] = {{0, 0, 0}, {0, 0, 0}};
+    for(unsigned int y = 0, n[2] = {0u, 0u}; y != 4u; ++y)
+      for(unsigned int x = 0; x != 4u; ++x)
+      {
+        unsigned int sub = flip ? y / 2u : x / 2u;
+        unsigned char const* p = block + (y * 4u + x) * 4u;
+        pixels[sub][n[sub]] = p;
+        positions[sub][n[sub]++] = x * 4u + y;
+        for(int c = 0; c != 3; ++c)
+          average[sub][c] += p[c];
+      }
+    for(int sub = 0; sub != 2; ++sub)
+      for(int c = 0; c != 3; ++c)
+        average[sub][c] = (average[sub][c] + 4) / 8;
+
+    for(int differential = 0; differential != 2; ++differential)
+    {
+      etc1_subblock s[2];
+      int q[2][3];
+      bool representable = true;
+      for(int c = 0; c != 3; ++c)
+      {
+        if(differential)
+        {
+          q[0][c] = etc1_quantize5(average[0][c]);
+          q[1][c] = etc1_quantize5(average[1][c]);
+          int d = q[1][c] - q[0][c];
+          if(d < -4 || d > 3)
+            representable = false;
+          s[0].base[c] = etc1_expand5(q[0][c]);
+          s[1].base[c] = etc1_expand5(q[1][c]);
+        }
+        else
+        {
+          q[0][c] = etc1_quantize4(average[0][c]);
+          q[1][c] = etc1_quantize4(average[1][c]);
+          s[0].base[c] = etc1_expand4(q[0][c]);
+          s[1].base[c] = etc1_expand4(q[1][c]);
+        }
+      }
+      if(!representable)
+        continue;
+
+      etc1_fit_subblock(pixels[0], s[0]);
+      etc1_fit_subblock(pixels[1], s[1]);
+      int error = s[0].error + s[1].error;
+      if(best_error >= 0 && error >= best_error)
+        continue;
+
+      boost::uint64_t bits = 0u;
+      for(int c = 0; c != 3; ++c)
+      {
+        unsigned int shift = 59 - c * 8;
+        if(differential)
+          bits |= (boost::uint64_t(q[0][c]) << shift)
+            | (boost::uint64_t((q[1][c] - q[0][c]) & 7) << (shift - 3));
+        else
+          bits |= (boost::uint64_t(q[0][c]) << (shift + 1))
+            | (boost::uint64_t(q[1][c]) << (shift - 3));
+      }
+      bits |= boost::uint64_t(s[0].table) << 37 | boost::uint64_t(s[1].table) << 34
+        | boost::uint64_t(differential) << 33 | boost::uint64_t(flip) << 32;
+      for(int sub = 0; sub != 2; ++sub)
+        for(int i = 0; i != 8; ++i)
+        {
+          unsigned int index = s[sub].indices[i], position = positions[sub][i];
+          bits |= boost::uint64_t(index >> 1) << (16 + position)
+            | boost::uint64_t(index & 1u) << position;
+        }
+
+      best_error = error;
+      best_bits = bits;
+    }
+  }
+  return best_bits;
+}
+
+inline void etc1_encode_rows(decoded_image const* image, unsigned char* out
+                             , unsigned int first_block_row, unsigned int last_block_row)
+{
+  unsigned int blocks_wide = (image->width + 3u) / 4u;
+  unsigned char block[64];
+  for(unsigned int by = first_block_row; by != last_block_row; ++by)
+    for(unsigned int bx = 0; bx != blocks_wide; ++bx)
+    {
+      // Edge blocks repeat the last row and column
+      for(unsigned int y = 0; y != 4u; ++y)
+      {
+        unsigned char const* row = image->row((std::min)(by * 4u + y, image->height - 1u));
+        for(unsigned int x = 0; x != 4u; ++x)
+          std::memcpy(block + (y * 4u + x) * 4u
+                      , row + (std::min)(bx * 4u + x, image->width - 1u) * 4u, 4u);
+      }
+
+      boost::uint64_t bits = etc1_encode_block(block);
+      unsigned char* o = out + (std::size_t(by) * blocks_wide + bx) * 8u;
+      for(int i = 0; i != 8; ++i)
+        o[i] = bits >> (56 - i * 8);
+    }
+}
+
+}
+
+// Transcodes RGBA pixels to ETC1 blocks, stored in compressed as a
+// decoded_image with format GL_ETC1_RGB8_OES and stride the size of a
+// row of blocks. Alpha is dropped. Block rows are split among threads,
+// 0 meaning one per core.
+inline void etc1_encode(decoded_image const& image, decoded_image& compressed
+                        , unsigned int threads = 0u)
+{
+  assert(image.format == GL_RGBA && image.type == GL_UNSIGNED_BYTE);
+  unsigned int blocks_wide = (image.width + 3u) / 4u, blocks_high = (image.height + 3u) / 4u;
+  compressed.width = image.width;
+  compressed.height = image.height;
+  compressed.stride = blocks_wide * 8u;
+  compressed.format = GL_ETC1_RGB8_OES;
+  compressed.type = 0u;
+  compressed.pixels.resize(std::size_t(compressed.stride) * blocks_high);
+  if(compressed.pixels.empty())
+    return;
+
+  if(!threads)
+    threads = (std::max)(1u, boost::thread::hardware_concurrency());
+  threads = (std::min)(threads, blocks_high);
+
+  boost::thread_group group;
+  unsigned int rows_per_thread = (blocks_high + threads - 1u) / threads;
+  for(unsigned int first = rows_per_thread; first < blocks_high; first += rows_per_thread)
+    group.create_thread(boost::bind(&detail::etc1_encode_rows, &image, &compressed.pixels[0]
+                                    , first, (std::min)(first + rows_per_thread, blocks_high)));
+  detail::etc1_encode_rows(&image, &compressed.pixels[0], 0u, (std::min)(rows_per_thread, blocks_high));
+  group.join_all();
+}
+
+} }
+
+#endif
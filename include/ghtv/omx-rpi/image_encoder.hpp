@@ -0,0 +1,442 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_IMAGE_ENCODER_HPP
+#define GHTV_OMX_RPI_IMAGE_ENCODER_HPP
+
+#include <IL/OMX_Broadcom.h>
+#include <GLES2/gl2.h>
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+#include <ghtv/omx-rpi/omx_events.hpp>
+#include <ghtv/omx-rpi/omx_graph.hpp>
+#include <ghtv/omx-rpi/input_buffer_pool.hpp>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+#include <cassert>
+#include <stdexcept>
+#include <cstring>
+
+namespace ghtv { namespace omx_rpi {
+
+// Encodes RGBA pixels to JPEG with OMX.broadcom.image_encode. The
+// component stays in Idle with its ports disabled between encodes,
+// since the input port can only be reconfigured while disabled. An
+// error fails the encode and the component is brought back to Idle,
+// or recreated if it doesn't get there. The buffers' memory comes from
+// input_buffer_pool, as the decoder's input does, so encodes of
+// similar sizes reuse it instead of allocating their own.
+struct image_encoder : detail::omx_events<image_encoder>, boost::noncopyable
+{
+  static OMX_ERRORTYPE handler_custom
+    (OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2, OMX_PTR pEventData)
+  {
+    image_encoder* self = static_cast<image_encoder*>(pAppData);
+    boost::unique_lock<boost::mutex> l(self->mutex);
+    if(eEvent == OMX_EventError)
+    {
+      std::cerr << "Error in image_encoder nData1 " << std::hex
+                << (unsigned long)nData1 << " nData2 " << (unsigned long)nData2
+                << std::dec << std::endl;
+      self->set_error(static_cast<OMX_ERRORTYPE>(nData1));
+      return OMX_ErrorNone;
+    }
+    if(wait_functions::complete_event(self, self->commands.events, eEvent, nData1, nData2))
+      self->condition.notify_all();
+    return OMX_ErrorNone;
+  }
+
+  static OMX_ERRORTYPE empty_buffer
+    (OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE* header)
+  {
+    image_encoder* self = static_cast<image_encoder*>(pAppData);
+    boost::unique_lock<boost::mutex> l(self->mutex);
+    self->free_input.push_back(header);
+    self->condition.notify_all();
+    return OMX_ErrorNone;
+  }
+
+  static OMX_ERRORTYPE filled_buffer
+    (OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE* header)
+  {
+    image_encoder* self = static_cast<image_encoder*>(pAppData);
+    boost::unique_lock<boost::mutex> l(self->mutex);
+    if(self->output_complete)
+      return OMX_ErrorNone; // Returned when the port is disabled
+
+    if(header->nFilledLen)
+    {
+      OMX_U8 const* data = header->pBuffer + header->nOffset;
+      self->output->insert(self->output->end(), data, data + header->nFilledLen);
+    }
+    if(header->nFlags & OMX_BUFFERFLAG_EOS)
+    {
+      self->output_complete = true;
+      self->condition.notify_all();
+    }
+    else
+    {
+      header->nFilledLen = 0;
+      header->nOffset = 0;
+      OMX_ERRORTYPE r = OMX_FillThisBuffer (hComponent, header);
+      if(r != OMX_ErrorNone)
+        self->set_error(r);
+    }
+    return OMX_ErrorNone;
+  }
+
+  static OMX_CALLBACKTYPE callbacks()
+  {
+    OMX_CALLBACKTYPE callbacks
+      = {&image_encoder::handler_custom, &image_encoder::empty_buffer
+         , &image_encoder::filled_buffer};
+    return callbacks;
+  }
+
+  // With a trace, as image_pipeline's
+  image_encoder(omx_trace* trace = 0)
+    : error(OMX_ErrorNone), commands(mutex, condition, command_events, error)
+    , output(0), output_complete(true)
+    , graph(this, callbacks(), trace)
+  {
+    encoder_handle = graph.get<encode_stage>().handle;
+    encoder_ports.in = graph.get<encode_stage>().in;
+    encoder_ports.out = graph.get<encode_stage>().out;
+
+    if(graph.disable_ports(commands) != OMX_ErrorNone
+       || graph.set_state(commands, OMX_StateIdle) != OMX_ErrorNone
+       || !commands.wait())
+      throw std::runtime_error("Couldn't initialize OMX.broadcom.image_encode");
+  }
+
+  ~image_encoder()
+  {
+    graph.set_state(commands, OMX_StateLoaded);
+    commands.wait();
+    graph.free_handles();
+  }
+
+  // Synchronous. rgba holds height rows of width pixels, stride bytes
+  // apart; quality goes from 1 to 100. Returns false if there was
+  // nothing to encode or the encoder failed.
+  bool encode(unsigned char const* rgba, unsigned int width, unsigned int height
+              , unsigned int stride, std::vector<unsigned char>& jpeg, unsigned int quality = 85u)
+  {
+    jpeg.clear();
+    if(!width || !height)
+      return false;
+
+    bool encoded = configure(width, height, quality) && start(jpeg);
+    if(encoded)
+    {
+      // Rows are fed in slices of input_port.format.image.nSliceHeight
+      // rows, as many slices as fit in a buffer
+      unsigned int input_stride = input_port.format.image.nStride
+        , slice_height = input_port.format.image.nSliceHeight
+        , rows_per_buffer = input_port.nBufferSize / input_stride / slice_height * slice_height;
+      assert(rows_per_buffer != 0u);
+      for(unsigned int row = 0; encoded && row != height;)
+      {
+        OMX_BUFFERHEADERTYPE* header = take_input_buffer();
+        if(!header)
+          break;
+        unsigned int rows = (std::min)(rows_per_buffer, height - row);
+        for(unsigned int i = 0; i != rows; ++i)
+          std::memcpy(header->pBuffer + i * input_stride, rgba + std::size_t(row + i) * stride, width * 4u);
+        row += rows;
+        header->nOffset = 0;
+        header->nFilledLen = rows * input_stride;
+        header->nFlags = row == height ? OMX_BUFFERFLAG_EOS : 0;
+        encoded = !failed(OMX_EmptyThisBuffer (encoder_handle, header));
+      }
+
+      boost::unique_lock<boost::mutex> l(mutex);
+      while(!output_complete && error == OMX_ErrorNone)
+        condition.wait(l);
+      encoded = error == OMX_ErrorNone;
+    }
+
+    if(!stop())
+      recreate();
+    // The encoder doesn't hold them anymore
+    release_memory(input_memory);
+    release_memory(output_memory);
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      error = OMX_ErrorNone;
+    }
+    return encoded && !jpeg.empty();
+  }
+
+  bool encode(decoded_image const& image, std::vector<unsigned char>& jpeg, unsigned int quality = 85u)
+  {
+    assert(image.format == GL_RGBA && image.type == GL_UNSIGNED_BYTE);
+    return encode(image.pixels.empty() ? 0 : &image.pixels[0], image.width, image.height
+                  , image.stride, jpeg, quality);
+  }
+
+private:
+  // Returns false if the encoder rejected the parameters
+  bool configure(unsigned int width, unsigned int height, unsigned int quality)
+  {
+    OMX_ERRORTYPE r;
+
+    input_port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+    input_port.nVersion.nVersion = OMX_VERSION;
+    input_port.nPortIndex = encoder_ports.in;
+    r = OMX_GetParameter (encoder_handle, OMX_IndexParamPortDefinition, &input_port);
+    if(failed(r))
+      return false;
+    input_port.format.image.nFrameWidth = width;
+    input_port.format.image.nFrameHeight = height;
+    // The encoder wants 32 byte aligned rows and slices of 16 rows
+    input_port.format.image.nStride = (width * 4u + 31u) & ~31u;
+    input_port.format.image.nSliceHeight = 16u;
+    input_port.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+    input_port.format.image.eColorFormat = OMX_COLOR_Format32bitABGR8888;
+    r = OMX_SetParameter (encoder_handle, OMX_IndexParamPortDefinition, &input_port);
+    if(failed(r))
+      return false;
+    // Read back the buffer size it derived
+    r = OMX_GetParameter (encoder_handle, OMX_IndexParamPortDefinition, &input_port);
+    if(failed(r))
+      return false;
+
+    output_port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+    output_port.nVersion.nVersion = OMX_VERSION;
+    output_port.nPortIndex = encoder_ports.out;
+    r = OMX_GetParameter (encoder_handle, OMX_IndexParamPortDefinition, &output_port);
+    if(failed(r))
+      return false;
+    output_port.format.image.nFrameWidth = width;
+    output_port.format.image.nFrameHeight = height;
+    output_port.format.image.nStride = 0;
+    output_port.format.image.nSliceHeight = 0;
+    output_port.format.image.eCompressionFormat = OMX_IMAGE_CodingJPEG;
+    output_port.format.image.eColorFormat = OMX_COLOR_FormatUnused;
+    r = OMX_SetParameter (encoder_handle, OMX_IndexParamPortDefinition, &output_port);
+    if(failed(r))
+      return false;
+    r = OMX_GetParameter (encoder_handle, OMX_IndexParamPortDefinition, &output_port);
+    if(failed(r))
+      return false;
+
+    OMX_IMAGE_PARAM_QFACTORTYPE q;
+    q.nSize = sizeof(q);
+    q.nVersion.nVersion = OMX_VERSION;
+    q.nPortIndex = encoder_ports.out;
+    q.nQFactor = (std::max)(1u, (std::min)(quality, 100u));
+    r = OMX_SetParameter (encoder_handle, OMX_IndexParamQFactor, &q);
+    return !failed(r);
+  }
+
+  // Enables both ports and moves to Executing with every output
+  // buffer queued. Returns false if the encoder failed
+  bool start(std::vector<unsigned char>& jpeg)
+  {
+    OMX_ERRORTYPE r;
+    void* null = 0;
+
+    commands.add_wait_command_result(CommandPortEnable, encoder_ports.in);
+    r = OMX_SendCommand (encoder_handle, OMX_CommandPortEnable, encoder_ports.in, null);
+    if(failed(r))
+      return false;
+    if(!use_buffers(input_port, input_buffers, input_memory))
+      return false;
+
+    commands.add_wait_command_result(CommandPortEnable, encoder_ports.out);
+    r = OMX_SendCommand (encoder_handle, OMX_CommandPortEnable, encoder_ports.out, null);
+    if(failed(r))
+      return false;
+    if(!use_buffers(output_port, output_buffers, output_memory))
+      return false;
+    if(!commands.wait())
+      return false;
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      free_input = input_buffers;
+      output = &jpeg;
+      output_complete = false;
+    }
+
+    commands.add_wait_command_result(CommandStateSet, OMX_StateExecuting);
+    r = OMX_SendCommand (encoder_handle, OMX_CommandStateSet, OMX_StateExecuting, null);
+    if(failed(r) || !commands.wait())
+      return false;
+
+    for(std::size_t i = 0; i != output_buffers.size(); ++i)
+    {
+      r = OMX_FillThisBuffer (encoder_handle, output_buffers[i]);
+      if(failed(r))
+        return false;
+    }
+    return true;
+  }
+
+  // Gives port its buffers, on memory taken from the pool. Returns
+  // false if the encoder failed or there is no memory
+  bool use_buffers(OMX_PARAM_PORTDEFINITIONTYPE const& port, std::vector<OMX_BUFFERHEADERTYPE*>& headers
+                   , std::vector<input_buffer_pool::buffer>& memory)
+  {
+    std::size_t alignment = (std::max<std::size_t>)(port.nBufferAlignment, sizeof (void*));
+    headers.assign(port.nBufferCountActual, static_cast<OMX_BUFFERHEADERTYPE*>(0));
+    memory.reserve(headers.size());
+    for(std::size_t i = 0; i != headers.size(); ++i)
+    {
+      input_buffer_pool::buffer b;
+      if(!input_buffer_pool::instance().acquire(port.nBufferSize, alignment, b))
+        return !failed(OMX_ErrorInsufficientResources);
+      memory.push_back(b);
+      if(failed(OMX_UseBuffer (encoder_handle, &headers[i], port.nPortIndex, 0, b.size, b.data)))
+        return false;
+    }
+    return true;
+  }
+
+  // The encoder must not hold it anymore
+  static void release_memory(std::vector<input_buffer_pool::buffer>& memory)
+  {
+    for(std::vector<input_buffer_pool::buffer>::const_iterator first = memory.begin()
+          , last = memory.end(); first != last; ++first)
+      input_buffer_pool::instance().release(*first);
+    memory.clear();
+  }
+
+  // Back to Idle with both ports disabled and their buffers freed,
+  // from wherever start or encode stopped. Returns false if the
+  // encoder is Invalid or doesn't complete the commands in time
+  bool stop()
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    void* null = 0;
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      output_complete = true;
+    }
+
+    OMX_STATETYPE state = graph.state<encode_stage>();
+    bool stopped = state == OMX_StateIdle
+      || ((state == OMX_StateExecuting || state == OMX_StatePause)
+          && graph.set_state<encode_stage>(commands, OMX_StateIdle) == OMX_ErrorNone
+          && commands.timed_wait(recovery_deadline()));
+
+    if(stopped)
+    {
+      if(graph.port_enabled<encode_stage>(encoder_ports.in))
+      {
+        commands.add_wait_command_result(CommandPortDisable, encoder_ports.in);
+        r = OMX_SendCommand (encoder_handle, OMX_CommandPortDisable, encoder_ports.in, null);
+      }
+      for(std::size_t i = 0; i != input_buffers.size(); ++i)
+        if(input_buffers[i])
+          OMX_FreeBuffer (encoder_handle, encoder_ports.in, input_buffers[i]);
+
+      if(r == OMX_ErrorNone && graph.port_enabled<encode_stage>(encoder_ports.out))
+      {
+        commands.add_wait_command_result(CommandPortDisable, encoder_ports.out);
+        r = OMX_SendCommand (encoder_handle, OMX_CommandPortDisable, encoder_ports.out, null);
+      }
+      for(std::size_t i = 0; i != output_buffers.size(); ++i)
+        if(output_buffers[i])
+          OMX_FreeBuffer (encoder_handle, encoder_ports.out, output_buffers[i]);
+      stopped = r == OMX_ErrorNone && commands.timed_wait(recovery_deadline());
+    }
+
+    boost::unique_lock<boost::mutex> l(mutex);
+    input_buffers.clear();
+    output_buffers.clear();
+    free_input.clear();
+    output = 0;
+    return stopped;
+  }
+
+  // A new handle in Idle with its ports disabled, for an encoder that
+  // wouldn't stop. Throws if even that fails
+  void recreate()
+  {
+    encoder_handle = graph.recreate<encode_stage>().handle;
+    if(graph.disable_ports(commands) != OMX_ErrorNone
+       || graph.set_state(commands, OMX_StateIdle) != OMX_ErrorNone
+       || !commands.timed_wait(recovery_deadline()))
+      throw std::runtime_error("Couldn't recover OMX.broadcom.image_encode");
+  }
+
+  // Already locked. Records the first error and ends every wait
+  void set_error(OMX_ERRORTYPE e)
+  {
+    if(error == OMX_ErrorNone)
+      error = e;
+    condition.notify_all();
+  }
+
+  // Returns true, failing the encode, if r is an error
+  bool failed(OMX_ERRORTYPE r)
+  {
+    if(r == OMX_ErrorNone)
+      return false;
+    boost::unique_lock<boost::mutex> l(mutex);
+    set_error(r);
+    return true;
+  }
+
+  // Null if the encode failed
+  OMX_BUFFERHEADERTYPE* take_input_buffer()
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    while(free_input.empty() && error == OMX_ErrorNone)
+      condition.wait(l);
+    if(error != OMX_ErrorNone)
+      return 0;
+    OMX_BUFFERHEADERTYPE* header = free_input.back();
+    free_input.pop_back();
+    return header;
+  }
+
+  struct ports
+  {
+    int in;
+    int out;
+  };
+
+  boost::mutex mutex;
+  boost::condition_variable condition;
+  std::vector<wait_event> command_events;
+  // First error of the encode
+  OMX_ERRORTYPE error;
+  initialization_queue commands;
+
+  OMX_PARAM_PORTDEFINITIONTYPE input_port, output_port;
+  std::vector<OMX_BUFFERHEADERTYPE*> input_buffers, output_buffers, free_input;
+  std::vector<input_buffer_pool::buffer> input_memory, output_memory;
+  std::vector<unsigned char>* output;
+  bool output_complete;
+
+  omx_graph<boost::mpl::vector<encode_stage> > graph;
+  OMX_HANDLETYPE encoder_handle;
+  ports encoder_ports;
+};
+
+} }
+
+#endif
@@ -0,0 +1,289 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_IMAGE_HEADER_HPP
+#define GHTV_OMX_RPI_IMAGE_HEADER_HPP
+
+#include <boost/cstdint.hpp>
+
+#include <vector>
+#include <string>
+#include <cstring>
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ghtv { namespace omx_rpi {
+
+enum image_coding
+{
+  coding_unknown, coding_png, coding_jpeg
+};
+
+// What can be learned about an image from its first bytes, without
+// decoding it.
+struct image_header
+{
+  image_coding coding;
+  unsigned int width;
+  unsigned int height;
+  // Embedded EXIF JPEG thumbnail, thumbnail_length is 0 if there is none
+  std::size_t thumbnail_offset;
+  std::size_t thumbnail_length;
+  // EXIF Orientation, from 1 to 8, 1 when the image is stored upright
+  unsigned int orientation;
+
+  image_header()
+    : coding(coding_unknown), width(0u), height(0u)
+    , thumbnail_offset(0u), thumbnail_length(0u), orientation(1u)
+  {}
+};
+
+// How to turn a decoded image for display: mirrored left to right
+// first, if mirror is set, then rotated clockwise by rotation degrees,
+// one of 0, 90, 180 or 270. exif asks for the transform the image's
+// EXIF Orientation describes instead.
+struct image_transform
+{
+  unsigned int rotation;
+  bool mirror;
+  bool exif;
+
+  image_transform(unsigned int rotation = 0u, bool mirror = false)
+    : rotation(rotation % 360u), mirror(mirror), exif(false)
+  {}
+
+  static image_transform from_exif()
+  {
+    image_transform t;
+    t.exif = true;
+    return t;
+  }
+
+  static image_transform from_exif_orientation(unsigned int orientation)
+  {
+    switch(orientation)
+    {
+    case 2: return image_transform(0u, true);
+    case 3: return image_transform(180u);
+    case 4: return image_transform(180u, true);
+    case 5: return image_transform(270u, true);
+    case 6: return image_transform(90u);
+    case 7: return image_transform(90u, true);
+    case 8: return image_transform(270u);
+    default: return image_transform();
+    }
+  }
+
+  bool identity() const
+  {
+    return !exif && !rotation && !mirror;
+  }
+  // Width and height trade places
+  bool transposes() const
+  {
+    return rotation == 90u || rotation == 270u;
+  }
+};
+
+inline bool operator==(image_transform const& lhs, image_transform const& rhs)
+{
+  return lhs.rotation == rhs.rotation && lhs.mirror == rhs.mirror && lhs.exif == rhs.exif;
+}
+
+inline bool operator!=(image_transform const& lhs, image_transform const& rhs)
+{
+  return !(lhs == rhs);
+}
+
+namespace detail {
+
+inline bool read_at(int fd, std::size_t offset, void* data, std::size_t size)
+{
+  return ::pread(fd, data, size, offset) == (ssize_t)size;
+}
+
+inline unsigned int big_endian_16(unsigned char const* p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+inline boost::uint32_t big_endian_32(unsigned char const* p)
+{
+  return (boost::uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// A TIFF structure as embedded in an EXIF APP1 segment
+struct tiff_reader
+{
+  unsigned char const* data;
+  std::size_t size;
+  bool big_endian;
+
+  bool valid(std::size_t offset, std::size_t length) const
+  {
+    return offset <= size && length <= size - offset;
+  }
+  unsigned int u16(std::size_t offset) const
+  {
+    unsigned char const* p = data + offset;
+    return big_endian ? big_endian_16(p) : (p[1] << 8) | p[0];
+  }
+  boost::uint32_t u32(std::size_t offset) const
+  {
+    unsigned char const* p = data + offset;
+    return big_endian ? big_endian_32(p)
+      : (boost::uint32_t(p[3]) << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+  }
+
+  // Calls f(tag, value_offset) for each entry of the IFD at offset and
+  // returns the offset of the next IFD, 0 if none or malformed
+  template <typename F>
+  boost::uint32_t for_each_entry(std::size_t offset, F& f) const
+  {
+    if(!offset || !valid(offset, 2u))
+      return 0u;
+    unsigned int count = u16(offset);
+    offset += 2u;
+    if(!valid(offset, count * 12u + 4u))
+      return 0u;
+    for(unsigned int i = 0; i != count; ++i, offset += 12u)
+      f(*this, u16(offset), offset + 8u);
+    return u32(offset);
+  }
+};
+
+struct exif_thumbnail_entries
+{
+  boost::uint32_t offset, length;
+
+  void operator()(tiff_reader const& tiff, unsigned int tag, std::size_t value)
+  {
+    if(tag == 0x0201) // JPEGInterchangeFormat
+      offset = tiff.u32(value);
+    else if(tag == 0x0202) // JPEGInterchangeFormatLength
+      length = tiff.u32(value);
+  }
+};
+
+struct exif_orientation_entries
+{
+  unsigned int orientation;
+
+  void operator()(tiff_reader const& tiff, unsigned int tag, std::size_t value)
+  {
+    if(tag == 0x0112) // Orientation, a SHORT
+      orientation = tiff.u16(value);
+  }
+};
+
+inline void parse_exif(unsigned char const* data, std::size_t size
+                       , std::size_t tiff_file_offset, image_header& header)
+{
+  if(size < 8u || (std::memcmp(data, "II", 2) && std::memcmp(data, "MM", 2)))
+    return;
+  tiff_reader tiff = {data, size, data[0] == 'M'};
+  if(tiff.u16(2u) != 42u)
+    return;
+
+  exif_orientation_entries ifd0 = {1u};
+  exif_thumbnail_entries ifd1 = {0u, 0u};
+  tiff.for_each_entry(tiff.for_each_entry(tiff.u32(4u), ifd0), ifd1);
+  if(ifd0.orientation >= 1u && ifd0.orientation <= 8u)
+    header.orientation = ifd0.orientation;
+  if(ifd1.length && ifd1.offset)
+  {
+    header.thumbnail_offset = tiff_file_offset + ifd1.offset;
+    header.thumbnail_length = ifd1.length;
+  }
+}
+
+inline void probe_jpeg(int fd, image_header& header, std::vector<unsigned char>& segment)
+{
+  std::size_t offset = 2u;
+  unsigned char marker[4];
+  while(read_at(fd, offset, marker, sizeof(marker)) && marker[0] == 0xFF)
+  {
+    unsigned int type = marker[1], length = big_endian_16(marker + 2);
+    if(type == 0xDA || type == 0xD9 || length < 2u) // Start of scan or end of image
+      break;
+
+    if(type == 0xE1 && length > 8u && !header.thumbnail_length)
+    {
+      segment.resize(length - 2u);
+      if(read_at(fd, offset + 4u, &segment[0], segment.size())
+         && !std::memcmp(&segment[0], "Exif\0\0", 6))
+        parse_exif(&segment[6], segment.size() - 6u, offset + 10u, header);
+    }
+    else if(type >= 0xC0 && type <= 0xCF && type != 0xC4 && type != 0xC8 && type != 0xCC)
+    {
+      unsigned char frame[5];
+      if(read_at(fd, offset + 4u, frame, sizeof(frame)))
+      {
+        header.height = big_endian_16(frame + 1);
+        header.width = big_endian_16(frame + 3);
+      }
+      break;
+    }
+    offset += 2u + length;
+  }
+}
+
+}
+
+// segment holds EXIF data while it is parsed, passing the same
+// vector to every call saves reallocating it
+inline bool probe_image_header(int fd, image_header& header, std::vector<unsigned char>& segment)
+{
+  header = image_header();
+  unsigned char signature[24];
+  if(!detail::read_at(fd, 0u, signature, sizeof(signature)))
+    return false;
+
+  if(!std::memcmp(signature, "\x89PNG\r\n\x1a\n", 8) && !std::memcmp(signature + 12, "IHDR", 4))
+  {
+    header.coding = coding_png;
+    header.width = detail::big_endian_32(signature + 16);
+    header.height = detail::big_endian_32(signature + 20);
+  }
+  else if(signature[0] == 0xFF && signature[1] == 0xD8)
+  {
+    header.coding = coding_jpeg;
+    detail::probe_jpeg(fd, header, segment);
+  }
+  return header.coding != coding_unknown;
+}
+
+inline bool probe_image_header(int fd, image_header& header)
+{
+  std::vector<unsigned char> segment;
+  return probe_image_header(fd, header, segment);
+}
+
+inline bool probe_image_header(std::string const& path, image_header& header)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return false;
+  bool r = probe_image_header(fd, header);
+  ::close(fd);
+  return r;
+}
+
+} }
+
+#endif
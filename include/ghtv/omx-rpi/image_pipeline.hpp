@@ -22,6 +22,19 @@
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
 
+#include <ghtv/omx-rpi/decoded_image.hpp>
+#include <ghtv/omx-rpi/decoded_image_cache.hpp>
+#include <ghtv/omx-rpi/shared_image_cache.hpp>
+#include <ghtv/omx-rpi/texture_atlas.hpp>
+#include <ghtv/omx-rpi/tiled_image.hpp>
+#include <ghtv/omx-rpi/image_header.hpp>
+#include <ghtv/omx-rpi/omx_events.hpp>
+#include <ghtv/omx-rpi/omx_graph.hpp>
+#include <ghtv/omx-rpi/input_buffer_pool.hpp>
+#include <ghtv/omx-rpi/yuv_texture.hpp>
+#include <ghtv/omx-rpi/mipmap.hpp>
+#include <ghtv/omx-rpi/etc1.hpp>
+
 #include <boost/optional.hpp>
 #include <boost/utility/typed_in_place_factory.hpp>
 #include <boost/variant.hpp>
@@ -29,14 +42,21 @@
 #include <boost/thread/condition_variable.hpp>
 #include <boost/ref.hpp>
 #include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/bind.hpp>
 
 #include <vector>
 #include <stdexcept>
 #include <iostream>
 #include <cassert>
-#include <fstream>
 #include <cstdlib>
 #include <cstring>
+#include <cerrno>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace ghtv { namespace omx_rpi {
 
@@ -59,7 +79,7 @@ OMX_IMAGE_PARAM_PORTFORMATTYPE make_image_param_portformattype(OMX_U32 nPortInde
   
 }
 
-struct image_pipeline
+struct image_pipeline : detail::omx_events<image_pipeline>
 {
   static OMX_ERRORTYPE empty_buffer
     (OMX_HANDLETYPE hComponent, OMX_PTR pAppData, OMX_BUFFERHEADERTYPE * buffer_header)
@@ -91,12 +111,54 @@ struct image_pipeline
     
     assert(!!self->load_queue);
 
-    boost::function<void(bool)> f = self->load_queue->callback;
+    if(self->load_queue->output_complete)
+      return OMX_ErrorNone; // Returned by the flush in reset
 
-    l.unlock();
+    if(hComponent == self->decoder_handle)
+    {
+      // CPU output path, the buffer holds a slice of the decoded image
+      if(self->load_queue->deferred_output)
+      {
+        self->load_queue->filled_output.push_back(pBufferHeader);
+        self->condition.notify_all();
+        return OMX_ErrorNone;
+      }
+      if(!self->load_queue->copy_output(pBufferHeader))
+      {
+        OMX_ERRORTYPE r = OMX_FillThisBuffer (hComponent, pBufferHeader);
+        if(r != OMX_ErrorNone)
+        {
+          boost::function<void(bool)> f;
+          self->set_error(r, f);
+          l.unlock();
+          if(f)
+            f(false);
+        }
+        return OMX_ErrorNone;
+      }
+    }
+    else if(!self->ring.empty())
+    {
+      std::size_t index = self->frame_filled(pBufferHeader);
+      if(self->error != OMX_ErrorNone)
+        return OMX_ErrorNone;
+      l.unlock();
+      // frame_ready is only assigned before the stream starts
+      self->frame_ready(index);
+      return OMX_ErrorNone;
+    }
+    else
+      self->load_queue->output_complete = true;
 
+    // Swapped rather than copied, copying a large functor allocates
+    boost::function<void(bool)> f;
+    f.swap(self->load_queue->callback);
+    self->load_queue->succeeded = true;
+
+    l.unlock();
 
-    f(true);
+    if(f)
+      f(true);
     
 
     return OMX_ErrorNone;
@@ -117,7 +179,13 @@ struct image_pipeline
                 << pEventData
                 << std::dec
                 << std::endl;
-      std::abort();
+      // The load fails, reset() recovers the components
+      boost::function<void(bool)> f;
+      self->set_error(static_cast<OMX_ERRORTYPE>(nData1), f);
+      l.unlock();
+      if(f)
+        f(false);
+      return OMX_ErrorNone;
     }
     else if(eEvent == OMX_EventBufferFlag)
     {
@@ -135,97 +203,46 @@ struct image_pipeline
       return OMX_ErrorNone;
     }
 
-    if(self->init_queue)
+    if(self->init_queue
+       && wait_functions::complete_event(self, self->init_queue->events, eEvent, nData1, nData2))
     {
-
-      std::vector<wait_event>::iterator
-        first = self->init_queue->events.begin()
-        , last = self->init_queue->events.end();
-      while(first != last && (first->event != eEvent || first->nData1 != nData1 || first->nData2 != nData2))
-        ++first;
-      if(first != last)
-      {
-        self->init_queue->events.erase(first);
-        if(self->init_queue->events.empty())
-        {
-
-          self->condition.notify_one();
-
-          return OMX_ErrorNone;
-        }
-      }
+      self->condition.notify_one();
+      return OMX_ErrorNone;
     }
 
-    if(self->load_queue)
-    {
-
-      std::vector<wait_event>::iterator
-        first = self->load_queue->events.begin()
-        , last = self->load_queue->events.end();
-      while(first != last && (first->event != eEvent || first->nData1 != nData1 || first->nData2 != nData2))
-      {
-
-        ++first;
-      }
-      if(first != last)
-      {
-
-        if(first->callback)
-          (self ->* first->callback)();
-        self->load_queue->events.erase(first);
-        if(self->load_queue->events.empty())
-        {
-          self->condition.notify_one();
-
-          return OMX_ErrorNone;
-        }
-      }
-    }
-    
+    if(self->load_queue
+       && wait_functions::complete_event(self, self->load_queue->events, eEvent, nData1, nData2))
+      self->condition.notify_one();
 
     return OMX_ErrorNone;
   }
   
-  image_pipeline()
-    : init_queue(boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition)))
+  static OMX_CALLBACKTYPE callbacks()
   {
-    OMX_ERRORTYPE r;
-    static_cast<void>(r);
-
-    // Synchronous
-    ::OMX_Init();
-
-    // Synchronous
     OMX_CALLBACKTYPE callbacks
       = {&image_pipeline::handler_custom, &image_pipeline::empty_buffer
          , &image_pipeline::filled_buffer};
-    r = OMX_GetHandle (&decoder_handle, const_cast<char*>("OMX.broadcom.image_decode"), this, &callbacks);
-    assert(r == OMX_ErrorNone);
-
-    // Synchronous
-    OMX_CALLBACKTYPE renderer_callbacks
-      = {&image_pipeline::handler_custom, &image_pipeline::empty_buffer
-         , &image_pipeline::filled_buffer};
-    r = OMX_GetHandle (&renderer_handle, const_cast<char*>("OMX.broadcom.egl_render"), this, &renderer_callbacks);
-    assert(r == OMX_ErrorNone);
-
-    {
-      OMX_PORT_PARAM_TYPE port;
-      port.nSize = sizeof (OMX_PORT_PARAM_TYPE);
-      port.nVersion.nVersion = OMX_VERSION;
+    return callbacks;
+  }
 
-      // Synchronous
-      r = OMX_GetParameter (decoder_handle, OMX_IndexParamImageInit, &port);
-      assert(r == OMX_ErrorNone);
-      decoder_ports.in = port.nStartPortNumber;
-      decoder_ports.out = port.nStartPortNumber + 1;
+  // With a trace, the components' calls and callbacks are recorded
+  // to it, or replayed from it without the components
+  image_pipeline(omx_trace* trace = 0)
+    : init_queue(boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition), boost::ref(arena.init_events), boost::cref(error)))
+    , input_buffers_wanted(0u), unstarved_loads(0u)
+    , cache(0), shared_cache(0), cached_load(false), error(OMX_ErrorNone)
+    , frames_decoded(0u), frames_dropped(0u)
+    , graph(this, callbacks(), trace)
+  {
+    OMX_ERRORTYPE r;
+    static_cast<void>(r);
 
-    // Synchronous
-      r = OMX_GetParameter (renderer_handle, OMX_IndexParamVideoInit, &port);
-      assert(r == OMX_ErrorNone);
-      renderer_ports.in = port.nStartPortNumber;
-      renderer_ports.out = port.nStartPortNumber + 1;
-    }
+    decoder_handle = graph.get<decode_stage>().handle;
+    decoder_ports.in = graph.get<decode_stage>().in;
+    decoder_ports.out = graph.get<decode_stage>().out;
+    renderer_handle = graph.get<render_stage>().handle;
+    renderer_ports.in = graph.get<render_stage>().in;
+    renderer_ports.out = graph.get<render_stage>().out;
 
     // Synchronous
     OMX_IMAGE_PARAM_PORTFORMATTYPE image_port_format
@@ -233,354 +250,704 @@ struct image_pipeline
                                                  , OMX_COLOR_FormatUnused);
     r = OMX_SetParameter (decoder_handle, OMX_IndexParamImagePortFormat, &image_port_format);
     assert(r == OMX_ErrorNone);
+    input_coding = OMX_IMAGE_CodingPNG;
+
+    arena.init_events.reserve(8u);
+    arena.load_events.reserve(8u);
+    arena.file_path.reserve(256u);
+    // However the input buffers are shaped
+    buffers.reserve(max_input_buffers);
+    buffer_headers.reserve(max_input_buffers);
+    arena.used_buffer_headers.reserve(max_input_buffers);
+    arena.released_buffer_headers.reserve(max_input_buffers);
     
-    // Assynchronous - Initialization queue
-    void* null = 0;
-    init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.in);
-    r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.in, null);
-    assert(r == OMX_ErrorNone);
-    
-    init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.out);
-    r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.out, null);
-    assert(r == OMX_ErrorNone);
+    // Assynchronous - Initialization queue, the decoder waits for
+    // its input in Executing
+    if(graph.disable_ports(*init_queue) != OMX_ErrorNone
+       || graph.set_state(*init_queue, OMX_StateIdle) != OMX_ErrorNone
+       || graph.set_state<decode_stage>(*init_queue, OMX_StateExecuting) != OMX_ErrorNone)
+      throw std::runtime_error("Couldn't initialize the image pipeline components");
+  }
 
-    init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.in);
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.in, null);
-    assert(r == OMX_ErrorNone);
+  // Between loads. Moves the components to Loaded and frees their
+  // handles, so no callback comes after it, nor through a trace
+  // destroyed after it
+  ~image_pipeline()
+  {
+    assert(!load_queue);
+    // The decoder may still be going back to Executing
+    if(init_queue)
+      init_queue->timed_wait(recovery_deadline());
+    init_queue = boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition), boost::ref(arena.init_events), boost::cref(error));
+    if(stop_component<decode_stage>() && stop_component<render_stage>()
+       && graph.set_state(*init_queue, OMX_StateLoaded) == OMX_ErrorNone)
+      init_queue->timed_wait(recovery_deadline());
+    graph.free_handles();
+  }
 
-    init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.out);
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.out, null);
-    assert(r == OMX_ErrorNone);
-    
-    init_queue->add_wait_command_result(CommandStateSet, OMX_StateIdle);
-    r = OMX_SendCommand (decoder_handle, OMX_CommandStateSet, OMX_StateIdle, null);
-    assert(r == OMX_ErrorNone);
+  // transform turns the image as egl_render writes the texture, the
+  // texture then has the turned dimensions
+  template <typename F>
+  void load_image(std::string const& file, int texture_id, EGLDisplay* eglDisplay, EGLContext* eglContext, F f
+                  , image_transform transform = image_transform())
+  {
+    assert(!load_queue && !cached_load);
+    boost::optional<image_header> header;
+    if(untransformed(file, transform, header) && find_cached(file, texture_id))
+    {
+      cached_load = true;
+      f(true);
+      return;
+    }
 
-    r = OMX_SendCommand (renderer_handle, OMX_CommandStateSet, OMX_StateIdle, null);
-    assert(r == OMX_ErrorNone);
+    load_texture(file, texture_id, eglDisplay, eglContext, f, transform
+                 , 0u, std::size_t(-1), header);
+  }
 
-    init_queue->add_wait_command_result(CommandStateSet, OMX_StateExecuting);
-    r = OMX_SendCommand (decoder_handle,  OMX_CommandStateSet, OMX_StateExecuting, null);
-    assert(r == OMX_ErrorNone);
+  // Two phase load. The preview, decoded from the thumbnail embedded
+  // in the image's EXIF data, is loaded into preview_texture_id and
+  // preview_f called before the full resolution load into texture_id
+  // starts, which then completes as the single phase load does.
+  // preview_f(false) is called when there is no thumbnail, or when
+  // the image is cached and there is no point in a preview.
+  template <typename P, typename F>
+  void load_image(std::string const& file, int preview_texture_id, int texture_id
+                  , EGLDisplay* eglDisplay, EGLContext* eglContext, P preview_f, F f
+                  , image_transform transform = image_transform())
+  {
+    assert(!load_queue && !cached_load);
+    boost::optional<image_header> header;
+    if(untransformed(file, transform, header) && find_cached(file, texture_id))
+    {
+      cached_load = true;
+      preview_f(false);
+      f(true);
+      return;
+    }
+
+    if(!header)
+    {
+      header = image_header();
+      probe_image_header(file, *header);
+    }
+    if(header->thumbnail_length)
+    {
+      load_completion completion;
+      load_texture(file, preview_texture_id, eglDisplay, eglContext
+                   , boost::bind(&load_completion::signal, &completion, _1)
+                   , transform, header->thumbnail_offset, header->thumbnail_length, header);
+      bool success = completion.wait();
+      reset();
+      preview_f(success);
+    }
+    else
+      preview_f(false);
+
+    load_texture(file, texture_id, eglDisplay, eglContext, f, transform
+                 , 0u, std::size_t(-1), header);
   }
 
+  // header, if given, is file's as probe_image_header found it
   template <typename F>
-  void load_image(std::string const& file, int texture_id, EGLDisplay* eglDisplay, EGLContext* eglContext, F f)
+  void load_texture(std::string const& file, int texture_id, EGLDisplay* eglDisplay, EGLContext* eglContext, F f
+                    , image_transform transform = image_transform()
+                    , std::size_t offset = 0u, std::size_t length = std::size_t(-1)
+                    , boost::optional<image_header> const& header = boost::none)
   {
-    OMX_ERRORTYPE r = OMX_ErrorNone;
-    void* null = 0;
-    static_cast<void>(r);
-    
-    assert(!load_queue);
     {
       boost::unique_lock<boost::mutex> l(mutex);
+      arena.probed_header = header;
       load_queue = boost::in_place<loading_image_queue>
-        (file, boost::ref(mutex), boost::ref(condition), eglDisplay, eglContext, texture_id, f);
+        (file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), eglDisplay, eglContext, texture_id
+         , static_cast<decoded_image*>(0), f);
       assert(load_queue->events.size() == 0);
       assert(load_queue->events.empty());
-
-      if(init_queue)
-      {
-
-        init_queue->wait(l);
-        init_queue = boost::none;
-
-      }
+      if(length != std::size_t(-1))
+        load_queue->set_input_range(offset, length);
     }
+    if(feed_until_output_port_changed())
+      output_texture(transform, false);
+  }
 
-    // We must request it before creating the buffers, but it will only complete
-    // when the buffers are all created
-    load_queue->add_wait_command_result(CommandPortEnable, decoder_ports.in);
-    r = OMX_SendCommand (decoder_handle, OMX_CommandPortEnable, decoder_ports.in, null);
-    assert(r == OMX_ErrorNone);
+  struct sequence_statistics
+  {
+    unsigned long decoded;
+    unsigned long dropped;
+  };
 
+  // One image of a batch load
+  struct texture_request
+  {
+    std::string file;
+    int texture_id;
+    image_transform transform;
 
+    texture_request(std::string const& file, int texture_id
+                    , image_transform transform = image_transform())
+      : file(file), texture_id(texture_id), transform(transform)
+    {}
+  };
 
+  // Batch load of a range of texture_request, as a screen full of
+  // images needs. The images are streamed back to back through the
+  // decoder input port while the components stay in Executing;
+  // between images only the ports after the decoder are cycled, for
+  // the new dimensions. image_done(index, success) is called as each
+  // texture is complete, index counted from first, then
+  // batch_done(loaded) with how many succeeded. Blocks until then and
+  // leaves the pipeline as reset() does, so there is no reset() to
+  // call. A change of coding between JPEG and PNG, or an error, costs
+  // the reset a single load has and the batch goes on.
+  template <typename Iterator, typename F, typename B>
+  void load_images(Iterator first, Iterator last, EGLDisplay* eglDisplay, EGLContext* eglContext
+                   , F image_done, B batch_done)
+  {
+    assert(!load_queue && !cached_load);
+    std::size_t loaded = 0u;
+    std::vector<std::pair<std::size_t, Iterator> > pending;
+    for(std::size_t index = 0u; first != last; ++first, ++index)
     {
-      std::size_t number_buffers = buffer_headers.size(), buffer_alignment = 0;
-      if(!number_buffers)
+      image_transform transform = first->transform;
+      boost::optional<image_header> header;
+      if(untransformed(first->file, transform, header) && find_cached(first->file, first->texture_id))
       {
-        OMX_PARAM_PORTDEFINITIONTYPE port;
-        port.nSize = sizeof(port);
-        port.nVersion.nVersion = OMX_VERSION;
-        port.nPortIndex = decoder_ports.in;
-        // Synchronous
-        r = OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port);
-
-        assert(r == OMX_ErrorNone);
-        number_buffers = port.nBufferCountActual;
-        buffer_size = /*port.nBufferSize*/ 909808;
-        buffer_alignment = port.nBufferAlignment;
+        ++loaded;
+        image_done(index, true);
       }
+      else
+        pending.push_back(std::make_pair(index, first));
+    }
 
-      buffer_headers.resize(number_buffers);
-
-      if(buffers.empty())
+    for(std::size_t i = 0; i != pending.size(); ++i)
+    {
+      texture_request const& request = *pending[i].second;
+      bool more = i + 1 != pending.size();
+      load_completion completion;
+      boost::function<void(bool)> f = boost::bind(&load_completion::signal, &completion, _1);
+
+      image_header header;
+      probe_image_header(request.file, header);
+      if(load_queue && input_coding_of(header) != input_coding)
+        reset();
+
+      if(load_queue)
+        load_next_texture(request, header, more, f);
+      else
       {
-        buffers.resize(number_buffers);
-        for (std::size_t i = 0; i != number_buffers; i++)
         {
-
-          posix_memalign(reinterpret_cast<void**>(&buffers[i]), buffer_alignment, buffer_size);
+          boost::unique_lock<boost::mutex> l(mutex);
+          arena.probed_header = header;
+          load_queue = boost::in_place<loading_image_queue>
+            (request.file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena)
+             , eglDisplay, eglContext, request.texture_id, static_cast<decoded_image*>(0), f);
+          load_queue->last_input = !more;
         }
+        if(feed_until_output_port_changed())
+          output_texture(request.transform, false);
       }
-      for (std::size_t i = 0; i != buffer_headers.size(); i++)
-      {
 
-        r = OMX_UseBuffer (decoder_handle, &buffer_headers[i].header
-                           , decoder_ports.in, 0, buffer_size
-                           , buffers[i]);
+      bool success = completion.wait();
+      if(success)
+        ++loaded;
+      image_done(pending[i].first, success);
+      // Recovers, the next image starts over
+      if(!success)
+        reset();
+    }
+    if(load_queue)
+      reset();
+    batch_done(loaded);
+  }
+
+  // Streaming mode: decodes a sequence of frames, each a complete
+  // image with the dimensions of the first, into a ring of count
+  // textures while the components keep running. next_frame(path)
+  // returns false when there are no more frames. frame_ready(index)
+  // is called on the OMX thread for each decoded frame; the renderer
+  // takes the latest frame with acquire_frame and gives it back with
+  // release_frame. A frame not acquired before the next one is decoded
+  // is dropped and its texture reused, so a slow renderer never stalls
+  // the decoder. Blocks until all frames were fed; reset() stops the
+  // stream, or recovers it after an error stopped it early. Returns
+  // false if next_frame gave no frame at all, in which case there is
+  // nothing to reset.
+  template <typename S, typename F>
+  bool load_sequence(S next_frame, int const* texture_ids, std::size_t count
+                     , EGLDisplay* eglDisplay, EGLContext* eglContext, F frame_ready
+                     , image_transform transform = image_transform())
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    void* null = 0;
+    static_cast<void>(r);
+
+    assert(!load_queue && !cached_load && count);
+    std::string path, next_path;
+    if(!next_frame(path))
+      return false;
+    bool more = next_frame(next_path);
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue = boost::in_place<loading_image_queue>
+        (path, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), eglDisplay, eglContext, texture_ids[0]
+         , static_cast<decoded_image*>(0), &image_pipeline::ignore_completion);
+      load_queue->last_input = !more;
+      this->frame_ready = frame_ready;
+      frames_decoded = frames_dropped = 0u;
+    }
+    // The first frame's orientation holds for the whole sequence
+    if(transform.exif)
+      transform = image_transform::from_exif_orientation(load_queue->header.orientation);
 
+    int width, height;
+    if(!feed_until_output_port_changed() || !tunnel_to_renderer(width, height)
+       || !set_renderer_transform(transform))
+      return true;
+    if(transform.transposes())
+      std::swap(width, height);
 
-        assert(r == OMX_ErrorNone);
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      ring.resize(count);
+      for(std::size_t i = 0; i != count; ++i)
+      {
+        ring[i].texture_id = texture_ids[i];
+        ring[i].texture_mem_handle = create_texture_image(texture_ids[i], width, height);
+        ring[i].header = 0;
+        ring[i].state = ring_slot::with_renderer;
+        ring[i].frame = 0u;
       }
     }
-    load_queue->released_buffer_headers = buffer_headers;
-    load_queue->used_buffer_headers.reserve(buffer_headers.size());
 
+    set_renderer_buffer_count(count);
+    r = OMX_SendCommand (renderer_handle, OMX_CommandPortEnable, renderer_ports.out, null);
+    if(failed(r))
+      return true;
+
+    for(std::size_t i = 0; i != count; ++i)
     {
-      OMX_PARAM_PORTDEFINITIONTYPE portdef;
+      r = OMX_UseEGLImage (renderer_handle, &ring[i].header, renderer_ports.out
+                           , reinterpret_cast<void*>(i), ring[i].texture_mem_handle);
+      if(failed(r))
+        return true;
+    }
 
-      portdef.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
-      portdef.nVersion.nVersion = OMX_VERSION;
-      portdef.nPortIndex = decoder_ports.out;
-      r = OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &portdef);
+    load_queue->add_wait_command_result(CommandStateSet, OMX_StateExecuting);
+    r = OMX_SendCommand (renderer_handle,  OMX_CommandStateSet, OMX_StateExecuting, null);
+    if(failed(r))
+      return true;
 
-      assert(r == OMX_ErrorNone);
-      // portdef.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
-      portdef.format.image.nFrameWidth = 161;
-      portdef.format.image.nFrameHeight = 64;
-      portdef.format.image.nStride = 160;
-      portdef.format.image.nSliceHeight = 64;
-      r = OMX_SetParameter (decoder_handle, OMX_IndexParamPortDefinition, &portdef);
+    load_queue->wait();
 
+    for(std::size_t i = 0; i != count; ++i)
+    {
+      r = OMX_FillThisBuffer (renderer_handle, ring[i].header);
+      if(failed(r))
+        return true;
+    }
 
-      assert(r == OMX_ErrorNone);
+    bool fed = feed_remaining_input();
+    while(more && fed)
+    {
+      path.swap(next_path);
+      more = next_frame(next_path);
+      load_queue->open_next(path, !more);
+      fed = feed_remaining_input();
     }
-    
-    load_queue->add_wait_command_result(EventPortSettingsChanged
-                                        , decoder_ports.out
-                                        , &image_pipeline::decoder_output_port_changed);
+    return true;
+  }
 
+  // Returns the index in the ring of the latest decoded frame, or -1
+  // if there is none since the last call
+  int acquire_frame()
+  {
+    unsigned long frame;
+    return acquire_frame(frame);
+  }
 
-    bool decoder_output_port_changed;
-    bool first = true;
-    do
-    {
+  // As above, frame is then the acquired frame's number in the
+  // sequence, counting from 1, so the renderer sees the frames
+  // dropped before it
+  int acquire_frame(unsigned long& frame)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    for(std::size_t i = 0; i != ring.size(); ++i)
+      if(ring[i].state == ring_slot::ready)
+      {
+        ring[i].state = ring_slot::acquired;
+        frame = ring[i].frame;
+        return i;
+      }
+    return -1;
+  }
 
-      load_queue->wait_buffers();
+  // Of the current or last sequence: frames decoded, and of those how
+  // many were dropped because the renderer didn't acquire them in time
+  sequence_statistics get_sequence_statistics()
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    sequence_statistics s = {frames_decoded, frames_dropped};
+    return s;
+  }
 
-      // Assynchronous with buffers AND PortChangedStatus
-      r = OMX_EmptyThisBuffer (decoder_handle, load_queue->fill_buffer(first));
+  void release_frame(int index)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    if(!load_queue || load_queue->output_complete)
+      return; // Stopped or stopping
+    assert(index >= 0 && std::size_t(index) < ring.size());
+    assert(ring[index].state == ring_slot::acquired);
+    ring[index].state = ring_slot::with_renderer;
+    OMX_ERRORTYPE r = OMX_FillThisBuffer (renderer_handle, ring[index].header);
+    if(r != OMX_ErrorNone)
+    {
+      boost::function<void(bool)> f;
+      set_error(r, f);
+    }
+  }
 
-      first = false;
-      assert(r == OMX_ErrorNone);
+  // CPU output path: the decoder output port is not tunneled, its
+  // buffers are copied into image, converted to RGBA when the decoder
+  // produces YUV. f is called once the whole image is in image, which
+  // reset() then stores in the caches, so it must outlive that call.
+  template <typename F>
+  void load_image(std::string const& file, decoded_image& image, F f)
+  {
+    assert(!load_queue && !cached_load);
+    if(find_cached(file, image))
+    {
+      cached_load = true;
+      f(true);
+      return;
+    }
+
+    {
       boost::unique_lock<boost::mutex> l(mutex);
-      decoder_output_port_changed = load_queue->decoder_output_port_changed;
+      load_queue = boost::in_place<loading_image_queue>
+        (file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), static_cast<EGLDisplay*>(0)
+         , static_cast<EGLContext*>(0), 0, &image, f);
+      load_queue->cpu_output = true;
+      load_queue->store_output = load_queue->stamp_input = cache || shared_cache;
     }
-    while(load_queue->file_offset != load_queue->file_size && !decoder_output_port_changed);
 
+    if(feed_until_output_port_changed() && enable_decoder_output())
+      feed_remaining_input();
+  }
 
-    load_queue->wait();
+  // Synchronous, unlike the other overloads: decodes through the CPU
+  // output path, uploads the image into atlas and resets the
+  // pipeline. Must be called with the atlas' EGL context current.
+  // Returns false if decoding failed or the image is larger than an
+  // atlas page.
+  bool load_image(std::string const& file, texture_atlas& atlas, atlas_region& region)
+  {
+    load_completion completion;
+    load_image(file, scratch_image, boost::bind(&load_completion::signal, &completion, _1));
+    bool success = completion.wait();
+    reset();
+
+    boost::optional<atlas_region> r;
+    if(success)
+      r = atlas.insert(scratch_image);
+    if(r)
+      region = *r;
+    return !!r;
+  }
 
+  // Synchronous: decodes through the CPU output path, uploading tiles
+  // as the decoder produces their rows and stopping the decode once
+  // the image's region is complete. Must be called with the tiled
+  // image's EGL context current.
+  bool load_image(std::string const& file, tiled_image& image)
+  {
+    assert(!load_queue && !cached_load);
+    if(find_cached(file, scratch_image))
+    {
+      image.upload(scratch_image);
+      return true;
+    }
 
-    r = OMX_SetupTunnel(decoder_handle, decoder_ports.out
-                        , renderer_handle, renderer_ports.in);
-    assert(r == OMX_ErrorNone);
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue = boost::in_place<loading_image_queue>
+        (file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), static_cast<EGLDisplay*>(0)
+         , static_cast<EGLContext*>(0), 0, static_cast<decoded_image*>(0)
+         , &image_pipeline::ignore_completion);
+      load_queue->cpu_output = true;
+      load_queue->deferred_output = true;
+    }
 
+    if(!feed_until_output_port_changed() || !enable_decoder_output())
+    {
+      reset();
+      return false;
+    }
 
-    load_queue->wait();
+    image.begin(load_queue->output_format.nFrameWidth, load_queue->output_format.nFrameHeight);
+    tile_slices handler = {*this, image, 0u};
+    drain_output(handler);
+    reset();
+    return image.complete();
+  }
 
-    
-    load_queue->add_wait_command_result(CommandPortEnable
-                                        , decoder_ports.out);
-    load_queue->add_wait_command_result(CommandPortEnable
-                                        , renderer_ports.in);
-    
-    r = OMX_SendCommand (decoder_handle, OMX_CommandPortEnable, decoder_ports.out, null);
-    assert(r == OMX_ErrorNone);
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortEnable, renderer_ports.in, null);
-    assert(r == OMX_ErrorNone);
+  // Synchronous: decodes through the CPU output path, transcodes the
+  // pixels to ETC1 on threads and uploads the blocks, an eighth of the
+  // RGBA size. The caches keep the compressed blocks, not the RGBA
+  // pixels, under the source path with an "#etc1" suffix. Must be
+  // called with the texture's EGL context current.
+  bool load_etc1_image(std::string const& file, GLuint texture_id, unsigned int threads = 0u)
+  {
+    assert(!load_queue && !cached_load);
+    std::string key = file + "#etc1";
+    source_stamp stamp;
+    bool cached = (cache || shared_cache) && make_source_stamp(file, stamp);
+    if(cached && find_cached(key, file, stamp, texture_id))
+      return true;
+
+    load_completion completion;
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue = boost::in_place<loading_image_queue>
+        (file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), static_cast<EGLDisplay*>(0)
+         , static_cast<EGLContext*>(0), 0, &scratch_image
+         , boost::bind(&load_completion::signal, &completion, _1));
+      load_queue->cpu_output = true;
+    }
 
+    if(feed_until_output_port_changed() && enable_decoder_output())
+      feed_remaining_input();
+    bool success = completion.wait();
+    reset();
+    if(!success)
+      return false;
+
+    decoded_image compressed;
+    etc1_encode(scratch_image, compressed, threads);
+    upload_texture(texture_id, compressed);
+    cached = cached && (stamp.hashed || hash_source(file, stamp));
+    if(cached && shared_cache)
+      shared_cache->publish(key, stamp, compressed);
+    if(cached && cache)
+      cache->store(key, stamp, compressed);
+    return true;
+  }
 
-    load_queue->wait();
+  // Synchronous: decodes through the CPU output path, as into a
+  // decoded_image, and uploads the image with a mip chain box-filtered
+  // from it on this thread, for textures drawn smaller than they are.
+  // Must be called with the texture's EGL context current. Returns
+  // false if decoding failed.
+  bool load_mipmapped_image(std::string const& file, GLuint texture_id)
+  {
+    load_completion completion;
+    load_image(file, scratch_image, boost::bind(&load_completion::signal, &completion, _1));
+    bool success = completion.wait();
+    reset();
+    if(success)
+      upload_mipmapped_texture(texture_id, scratch_image);
+    return success;
+  }
 
+  // Synchronous: decodes through the CPU output path and uploads the
+  // YUV planes as they come out of the decoder, packed in a luminance
+  // texture as layout then describes, to be drawn through
+  // yuv_fragment_shader_source. Skips egl_render and the conversion
+  // to RGBA, and takes 3/8 of the memory. Images the decoder doesn't
+  // output as YUV420, PNGs among them, are uploaded as RGBA with
+  // layout.planar false. The caches keep the packed planes under the
+  // source path with a "#yuv420" suffix. Must be called with the
+  // texture's EGL context current.
+  bool load_yuv_image(std::string const& file, GLuint texture_id, yuv_texture_layout& layout)
+  {
+    assert(!load_queue && !cached_load);
+    std::string key = file + "#yuv420";
+    source_stamp stamp;
+    bool cached = (cache || shared_cache) && make_source_stamp(file, stamp);
+    if(!cached || !find_cached(key, file, stamp, scratch_image))
+    {
+      load_completion completion;
+      {
+        boost::unique_lock<boost::mutex> l(mutex);
+        load_queue = boost::in_place<loading_image_queue>
+          (file, boost::ref(mutex), boost::ref(condition), boost::cref(error), boost::ref(arena), static_cast<EGLDisplay*>(0)
+           , static_cast<EGLContext*>(0), 0, &scratch_image
+           , boost::bind(&load_completion::signal, &completion, _1));
+        load_queue->cpu_output = true;
+        load_queue->planar_output = true;
+      }
 
+      if(feed_until_output_port_changed() && enable_decoder_output())
+        feed_remaining_input();
+      bool success = completion.wait();
+      reset();
+      if(!success)
+        return false;
+
+      cached = cached && (stamp.hashed || hash_source(file, stamp));
+      if(cached && shared_cache)
+        shared_cache->publish(key, stamp, scratch_image);
+      if(cached && cache)
+        cache->store(key, stamp, scratch_image);
+    }
 
+    upload_texture(texture_id, scratch_image);
+    // Odd widths are padded, the header has the image's
+    image_header header;
+    unsigned int width = 0u;
+    if(scratch_image.format == GL_LUMINANCE && probe_image_header(file, header)
+       && (header.width + 1u) / 2u * 2u == scratch_image.width)
+      width = header.width;
+    layout = yuv_texture_layout(scratch_image.width, scratch_image.height, scratch_image.format, width);
+    return true;
+  }
 
-    int width, height;
+  // Ends the load in progress early, as an error would: its
+  // completion is called with false and reset() then recovers the
+  // components. May be called from any thread, does nothing between
+  // loads or once the load completed.
+  void stop_load()
+  {
+    boost::function<void(bool)> f;
     {
-      OMX_PARAM_PORTDEFINITIONTYPE port;
-      port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
-      port.nVersion.nVersion = OMX_VERSION;
-      port.nPortIndex = decoder_ports.out;
-      OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port);
-      width = port.format.image.nFrameWidth;
-      height = port.format.image.nFrameHeight;
-
+      boost::unique_lock<boost::mutex> l(mutex);
+      if(!load_queue || load_queue->output_complete)
+        return;
+      set_error(OMX_ErrorNotReady, f);
     }
+    if(f)
+      f(false);
+  }
 
-    glBindTexture (GL_TEXTURE_2D, load_queue->texture_id);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, width, height
-                  , 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
-    load_queue->texture_mem_handle =
-      (eglCreateImageKHR
-       (*load_queue->eglDisplay, *load_queue->eglContext
-        , EGL_GL_TEXTURE_2D_KHR, (EGLClientBuffer) load_queue->texture_id, 0));
-
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortEnable, renderer_ports.out, null);
-    assert(r == OMX_ErrorNone);
-
-    /// should probably wait
-    
-    r = OMX_UseEGLImage (renderer_handle, &load_queue->texture_buffer_header
-                         , renderer_ports.out, null, load_queue->texture_mem_handle);
-    assert(r == OMX_ErrorNone);
-
-    load_queue->add_wait_command_result(CommandStateSet, OMX_StateExecuting);
-    r = OMX_SendCommand (renderer_handle,  OMX_CommandStateSet, OMX_StateExecuting, null);
-    assert(r == OMX_ErrorNone);
+  void set_cache(decoded_image_cache* c)
+  {
+    assert(!load_queue);
+    cache = c;
+  }
 
+  // Images are looked up in the shared cache before the on-disk one
+  void set_shared_cache(shared_image_cache* c)
+  {
+    assert(!load_queue);
+    shared_cache = c;
+  }
 
-    load_queue->wait();
+  template <typename Target>
+  bool find_cached(std::string const& file, Target& target)
+  {
+    if(!cache && !shared_cache)
+      return false;
 
+    source_stamp stamp;
+    if(!make_source_stamp(file, stamp))
+      return false;
+    return find_cached(file, file, stamp, target);
+  }
 
-    while(load_queue->file_offset != load_queue->file_size)
+  // key names the cached variant of the source file, or is file
+  template <typename Target>
+  bool find_cached(std::string const& key, std::string const& file, source_stamp& stamp
+                   , Target& target)
+  {
+    shared_image shared;
+    if(shared_cache && shared_cache->find(key, stamp, file, shared))
     {
-
-      load_queue->wait_buffers();
-
-
-      r = OMX_EmptyThisBuffer (decoder_handle, load_queue->fill_buffer(false));
-      assert(r == OMX_ErrorNone);
-
+      upload_cached(shared, target);
+      // Unless another process overwrote the pixels meanwhile
+      if(shared.intact())
+        return true;
     }
 
+    boost::shared_ptr<mapped_image> mapped;
+    if(cache && (mapped = cache->find(key, stamp, file)))
+    {
+      upload_cached(*mapped, target);
+      // Let the other processes map it instead of reading the file.
+      // The entry's hash holds for the file, it was found
+      if(shared_cache)
+      {
+        decoded_image image;
+        mapped->copy_to(image);
+        stamp.hash = mapped->header().source_hash;
+        stamp.hashed = true;
+        shared_cache->publish(key, stamp, image);
+      }
+      return true;
+    }
+    return false;
+  }
 
-    
-    r = OMX_FillThisBuffer (renderer_handle, load_queue->texture_buffer_header);
-
+  template <typename Cached>
+  static void upload_cached(Cached const& cached, int texture_id)
+  {
+    cached.upload(texture_id);
+  }
+  template <typename Cached>
+  static void upload_cached(Cached const& cached, decoded_image& image)
+  {
+    cached.copy_to(image);
   }
   
-  struct CommandPortDisable_type {} CommandPortDisable;
-  struct CommandPortEnable_type {} CommandPortEnable;
-  struct CommandStateSet_type {} CommandStateSet;
-  struct EventPortSettingsChanged_type {} EventPortSettingsChanged;
-
   boost::mutex mutex;
   boost::condition_variable condition;
 
-  struct wait_event
+  struct buffer_header
   {
-    OMX_EVENTTYPE event;
-    unsigned int nData1;
-    unsigned int nData2;
-    void (image_pipeline::* callback)();
+    OMX_BUFFERHEADERTYPE* header;
+
+    buffer_header() : header(0)
+    {}
   };
 
-  struct wait_functions
+  // Storage the queues borrow on every load. It keeps its capacity,
+  // so once grown to fit, loading doesn't allocate anymore
+  struct load_arena
   {
-    static void add_event_result
-      (boost::mutex& mutex, std::vector<wait_event>& events, CommandPortDisable_type, int p
-       , void (image_pipeline::* callback)() = 0)
-    {
-      boost::unique_lock<boost::mutex> l(mutex);
-      wait_event e = {OMX_EventCmdComplete, OMX_CommandPortDisable, (unsigned int)p, callback};
-      events.push_back(e);
-    }
-    
-    static void add_event_result
-      (boost::mutex& mutex, std::vector<wait_event>& events, CommandPortEnable_type, int p
-       , void (image_pipeline::* callback)() = 0)
-    {
-      boost::unique_lock<boost::mutex> l(mutex);
-      wait_event e = {OMX_EventCmdComplete, OMX_CommandPortEnable, (unsigned int)p, callback};
-      events.push_back(e);
-    }
-    
-    static void add_event_result
-      (boost::mutex& mutex, std::vector<wait_event>& events, CommandStateSet_type, OMX_STATETYPE s
-       , void (image_pipeline::* callback)() = 0)
-    {
-      boost::unique_lock<boost::mutex> l(mutex);
-      wait_event e = {OMX_EventCmdComplete, OMX_CommandStateSet, s, callback};
-      events.push_back(e);
-    }
-    static void add_event_result(boost::mutex& mutex, std::vector<wait_event>& events
-                                 , EventPortSettingsChanged_type c, int port
-                                 , void (image_pipeline::* callback)() = 0)
-    {
-      boost::unique_lock<boost::mutex> l(mutex);
-      wait_event e = {OMX_EventPortSettingsChanged, (unsigned int)port, 0u, callback};
-      events.push_back(e);
-    }
-
-    static void wait(boost::mutex& mutex, boost::unique_lock<boost::mutex>& l
-                     , boost::condition_variable& condition
-                     , std::vector<wait_event>& events)
-    {
-
-      while(!events.empty())
-      {
-        condition.wait(l);
-      }
-    }
+    std::vector<wait_event> init_events, load_events;
+    std::vector<buffer_header> used_buffer_headers, released_buffer_headers;
+    std::vector<OMX_BUFFERHEADERTYPE*> filled_output;
+    std::vector<unsigned char> header_segment;
+    std::string file_path;
+    // Set by a load that probed the file already, the next queue
+    // takes it instead of probing again
+    boost::optional<image_header> probed_header;
   };
+  load_arena arena;
 
-  struct initialization_queue
-  {
-    boost::mutex& mutex;
-    boost::condition_variable& condition;
+  boost::optional<initialization_queue> init_queue;
 
-    initialization_queue(boost::mutex& m, boost::condition_variable& c)
-      : mutex(m), condition(c) {}
-    
-    std::vector<wait_event> events;
+  // Lets the synchronous overloads wait for their own callback
+  struct load_completion
+  {
+    boost::mutex mutex;
+    boost::condition_variable condition;
+    bool done, success;
 
-    void add_wait_command_result(CommandPortDisable_type c, int p)
-    {
-      wait_functions::add_event_result(mutex, events, c, p);
-    }
-    
-    void add_wait_command_result(CommandPortEnable_type c, int p)
-    {
-      wait_functions::add_event_result(mutex, events, c, p);
-    }
-    
-    void add_wait_command_result(CommandStateSet_type c, OMX_STATETYPE s)
-    {
-      wait_functions::add_event_result(mutex, events, c, s);
-    }
+    load_completion() : done(false), success(false) {}
 
-    void wait(boost::unique_lock<boost::mutex>& l)
+    void signal(bool s)
     {
-      wait_functions::wait(mutex, l, condition, events);
+      boost::unique_lock<boost::mutex> l(mutex);
+      done = true;
+      success = s;
+      condition.notify_one();
     }
-    void wait()
+    bool wait()
     {
       boost::unique_lock<boost::mutex> l(mutex);
-      wait(l);
+      while(!done)
+        condition.wait(l);
+      return success;
     }
   };
 
-  boost::optional<initialization_queue> init_queue;
-  struct buffer_header
-  {
-    OMX_BUFFERHEADERTYPE* header;
-
-    buffer_header() : header(0)
-    {}
-  };
-
   struct loading_image_queue
   {
     boost::mutex& mutex;
     boost::condition_variable& condition;
-    std::ifstream file_stream;
-    std::vector<buffer_header> used_buffer_headers;
-    std::vector<buffer_header> released_buffer_headers;
+    OMX_ERRORTYPE const& error;
+    int file;
+    std::vector<buffer_header>& used_buffer_headers;
+    std::vector<buffer_header>& released_buffer_headers;
 
     std::size_t file_size;
     std::size_t file_offset;
@@ -591,12 +958,37 @@ struct image_pipeline
 
     boost::function<void(bool)> callback;
 
-    std::vector<wait_event> events;
+    std::vector<wait_event>& events;
 
     bool decoder_output_port_changed;
 
     OMX_BUFFERHEADERTYPE* texture_buffer_header;
     void* texture_mem_handle;
+
+    // CPU output path only
+    bool cpu_output;
+    bool deferred_output;
+    // YUV output is packed as yuv_texture_layout describes, not converted
+    bool planar_output;
+    std::vector<OMX_BUFFERHEADERTYPE*>& filled_output;
+    decoded_image* target;
+    OMX_IMAGE_PORTDEFINITIONTYPE output_format;
+    unsigned int output_rows;
+    bool output_complete;
+    std::string& file_path;
+    bool stamp_input;
+    // Stored by reset, off the OMX thread, once the load succeeded
+    bool store_output;
+    bool succeeded;
+    source_stamp stamp;
+    image_header header;
+
+    // Streaming mode, end of stream is only signaled after the last frame
+    bool last_input;
+
+    // The decoder ran out of queued input before the end of the file,
+    // for shaping the next load's buffers
+    bool starved;
     
     bool has_released_buffers() const
     {
@@ -605,25 +997,80 @@ struct image_pipeline
     }
 
     template <typename F>
-    loading_image_queue(std::string const& file_path
+    loading_image_queue(std::string const& path
                         , boost::mutex& mutex
                         , boost::condition_variable& condition
+                        , OMX_ERRORTYPE const& error
+                        , load_arena& arena
                         , EGLDisplay* eglDisplay
                         , EGLContext* eglContext
                         , int texture_id
+                        , decoded_image* target
                         , F f)
-      : mutex(mutex), condition(condition)
-      , file_stream(file_path.c_str()), file_size(0u), file_offset(0u)
+      : mutex(mutex), condition(condition), error(error)
+      , file(-1)
+      , used_buffer_headers(arena.used_buffer_headers)
+      , released_buffer_headers(arena.released_buffer_headers)
+      , file_size(0u), file_offset(0u)
       , eglDisplay(eglDisplay), eglContext(eglContext)
       , texture_id(texture_id)
       , callback(f)
+      , events(arena.load_events)
       , decoder_output_port_changed(false)
-      , texture_buffer_header(0)
+      , texture_buffer_header(0), texture_mem_handle(0)
+      , cpu_output(false), deferred_output(false), planar_output(false)
+      , filled_output(arena.filled_output)
+      , target(target), output_rows(0u), output_complete(false)
+      , file_path(arena.file_path), stamp_input(false), store_output(false), succeeded(false)
+      , last_input(true)
+      , starved(false)
+    {
+      used_buffer_headers.clear();
+      released_buffer_headers.clear();
+      events.clear();
+      filled_output.clear();
+      file_path.assign(path);
+
+      open(path);
+      if(arena.probed_header)
+        header = *arena.probed_header;
+      else
+        probe_image_header(file, header, arena.header_segment);
+      arena.probed_header = boost::none;
+    }
+
+    ~loading_image_queue()
+    {
+      if(file >= 0)
+        ::close(file);
+    }
+
+    // Streaming mode, continues feeding from the next frame's file
+    void open_next(std::string const& path, bool last)
+    {
+      open(path);
+      last_input = last;
+    }
+
+    void open(std::string const& path)
     {
-      file_stream.seekg(0, std::ios::end);
-      file_size = file_stream.tellg();
-      file_stream.seekg(0, std::ios::beg);
+      if(file >= 0)
+        ::close(file);
+      file = ::open(path.c_str(), O_RDONLY);
+      struct stat st;
+      bool opened = file >= 0 && ::fstat(file, &st) == 0;
+      if(!opened)
+        std::memset(&st, 0, sizeof(st));
+      file_size = st.st_size;
+      detail::stamp_stat(st, stamp);
+      file_offset = 0u;
+    }
 
+    // Feeds length bytes from offset instead of the whole file
+    void set_input_range(std::size_t offset, std::size_t length)
+    {
+      ::lseek(file, offset, SEEK_SET);
+      file_size = std::min(length, file_size - std::min(offset, file_size));
     }
 
     void add_wait_command_result(CommandStateSet_type c, OMX_STATETYPE s)
@@ -641,29 +1088,48 @@ struct image_pipeline
     {
       wait_functions::add_event_result(mutex, events, c, p, callback);
     }
+    void add_wait_command_result(CommandPortDisable_type c, int p)
+    {
+      wait_functions::add_event_result(mutex, events, c, p);
+    }
+    // The waits end early on an error
     void wait()
     {
       boost::unique_lock<boost::mutex> lock(mutex);
-      wait_functions::wait(mutex, lock, condition, events);
+      wait_functions::wait(mutex, lock, condition, events, error);
+    }
+    // Returns false if an error ended it, or the events didn't all
+    // complete by deadline
+    bool timed_wait(boost::system_time const& deadline)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      while(!events.empty() && error == OMX_ErrorNone)
+        if(!condition.timed_wait(l, deadline))
+          break;
+      return events.empty() && error == OMX_ErrorNone;
     }
     void wait_buffers()
     {
       boost::unique_lock<boost::mutex> l(mutex);
-      while(released_buffer_headers.empty())
+      while(released_buffer_headers.empty() && error == OMX_ErrorNone)
         condition.wait(l);
     }
 
     void wait_all_buffers()
     {
       boost::unique_lock<boost::mutex> l(mutex);
-      while(!used_buffer_headers.empty())
+      while(!used_buffer_headers.empty() && error == OMX_ErrorNone)
         condition.wait(l);
     }
     
     void empty_buffer(OMX_BUFFERHEADERTYPE* header)
     {
-      std::size_t index = reinterpret_cast<std::size_t>(header->pAppPrivate);
-      std::vector<buffer_header>::iterator iterator = used_buffer_headers.begin() + index;
+      // Positions in used_buffer_headers shift on every erase, so the
+      // header is looked up instead of remembered
+      std::vector<buffer_header>::iterator iterator = used_buffer_headers.begin();
+      while(iterator != used_buffer_headers.end() && iterator->header != header)
+        ++iterator;
+      assert(iterator != used_buffer_headers.end());
       released_buffer_headers.push_back(*iterator);
       used_buffer_headers.erase(iterator);
 
@@ -671,6 +1137,11 @@ struct image_pipeline
       header->nFilledLen = 0;
       header->nFlags = 0;
 
+      // The reader waiting for a buffer is no sign of starvation, it is
+      // faster than the decoder; the decoder left without input is
+      if(used_buffer_headers.empty() && file_offset != file_size)
+        starved = true;
+
       if(released_buffer_headers.size() == 1 || used_buffer_headers.empty())
         condition.notify_one();
     }
@@ -686,143 +1157,1100 @@ struct image_pipeline
       released_buffer_headers.pop_back();
 
       buffer_header& header = used_buffer_headers.back();
-      header.header->pAppPrivate = (void*)(used_buffer_headers.size() - 1);
 
+      // Within min_input_buffer_size
+      unsigned const small_file_size = 8750;
+      assert(file >= 0);
+      std::size_t read = read_input(header.header->pBuffer
+                                    , std::min<std::size_t>(file_size - file_offset
+                                                            , header.header->nAllocLen));
+      if(stamp_input)
+        stamp.hash = detail::fnv1a(header.header->pBuffer, read, stamp.hash);
+      bool small_image = first && file_size < small_file_size;
+      header.header->nFilledLen = small_image ? small_file_size : read ;
+      if(small_image)
+        std::memset(header.header->pBuffer + read
+                    , 0, small_file_size - read);
+
+      // A short file ends the input where it was cut
+      file_offset = read ? file_offset + read : file_size;
 
+      header.header->nFlags = file_size == file_offset
+        ? OMX_BUFFERFLAG_ENDOFFRAME | (last_input ? OMX_BUFFERFLAG_EOS : 0) : 0;
+
+
+      return header.header;
+    }
 
-      try
+    std::size_t read_input(OMX_U8* buffer, std::size_t size)
+    {
+      std::size_t done = 0u;
+      while(done != size)
       {
-        unsigned const small_file_size = 8750;
-        assert(file_stream.is_open());
-        std::size_t read = file_stream.rdbuf()->sgetn
-          (static_cast<char*>(static_cast<void*>(header.header->pBuffer))
-           , std::min(file_size - file_offset, header.header->nAllocLen));
-        bool small_image = first && file_size < small_file_size;
-        header.header->nFilledLen = small_image ? small_file_size : read ;
-        if(small_image)
-          std::memset(header.header->pBuffer + read
-                      , 0, small_file_size - read);
-
-        file_offset += read;
+        ssize_t r = ::read(file, buffer + done, size - done);
+        if(r < 0 && errno == EINTR)
+          continue;
+        if(r <= 0)
+          break;
+        done += r;
       }
-      catch(...)
+      return done;
+    }
+
+    // Copies the slice in header into target, returns true when the
+    // image is complete. Already locked
+    bool copy_output(OMX_BUFFERHEADERTYPE* header)
+    {
+      assert(!!target);
+      unsigned int stride = output_format.nStride
+        , height = output_format.nFrameHeight
+        , slice_height = output_format.nSliceHeight ? output_format.nSliceHeight : height
+        , rows = std::min(slice_height, height - output_rows);
+      unsigned char const* slice = header->pBuffer + header->nOffset;
+
+      if(header->nFilledLen && rows)
       {
-        strerror(errno);
-        throw;
+        if(target->format == GL_LUMINANCE)
+          detail::yuv420_slice_to_packed(slice, stride, slice_height, output_format.nFrameWidth
+                                         , output_format.nFrameHeight, output_rows, rows, *target);
+        else if(output_format.eColorFormat == OMX_COLOR_FormatYUV420PackedPlanar)
+          detail::yuv420_slice_to_rgba(slice, stride, slice_height, target->width, rows
+                                       , target->row(output_rows), target->stride);
+        else
+        {
+          rows = std::min<unsigned int>(rows, header->nFilledLen / stride);
+          detail::copy_rows(slice, stride, target->width * 4, rows
+                            , target->row(output_rows), target->stride);
+        }
+        output_rows += rows;
       }
 
-      header.header->nFlags = file_size == file_offset
-                                ? OMX_BUFFERFLAG_EOS | OMX_BUFFERFLAG_ENDOFFRAME : 0;
-
-
-      return header.header;
+      header->nFilledLen = 0;
+      header->nOffset = 0;
+      output_complete = (header->nFlags & OMX_BUFFERFLAG_EOS) || output_rows == height;
+      return output_complete;
     }
   };
 
+  void store_cached(loading_image_queue const& queue) const
+  {
+    assert(queue.stamp_input);
+    // Hashed as it was fed
+    source_stamp stamp = queue.stamp;
+    stamp.hashed = true;
+    if(shared_cache)
+      shared_cache->publish(queue.file_path, stamp, *queue.target);
+    if(cache)
+      cache->store(queue.file_path, stamp, *queue.target);
+  }
+
+  // Also recovers the components after a failed load
   void reset()
   {
+    if(cached_load)
+    {
+      assert(!load_queue);
+      cached_load = false;
+      return;
+    }
+
     assert(!!load_queue);
     assert(!init_queue);
 
+    if(failed())
+      return recover();
+
+    if(load_queue->store_output && load_queue->succeeded)
+      store_cached(*load_queue);
+
+    if(load_queue->cpu_output)
+    {
+      reset_decoded_output();
+      return;
+    }
+
 
     
     OMX_ERRORTYPE r;
-    static_cast<void>(r);
     void* null = 0;
-    init_queue = boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition));
-
+    init_queue = boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition), boost::ref(arena.init_events), boost::cref(error));
 
+    {
+      // Frames returned by the flush are not delivered
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue->output_complete = true;
+    }
     
     r = OMX_SendCommand (renderer_handle, OMX_CommandFlush, renderer_ports.out, null);
-    assert(r == OMX_ErrorNone);
+    if(failed(r))
+      return recover();
     // r = OMX_SendCommand (decoder_handle, OMX_CommandFlush, decoder_ports.in, null);
     // assert(r == OMX_ErrorNone);
     // r = OMX_SendCommand (decoder_handle, OMX_CommandFlush, decoder_ports.in, null);
     // assert(r == OMX_ErrorNone);
     r = OMX_SendCommand (decoder_handle, OMX_CommandFlush, decoder_ports.in, null);
-    assert(r == OMX_ErrorNone);
+    if(failed(r))
+      return recover();
 
 
     load_queue->wait_all_buffers();
 
 
-    init_queue->add_wait_command_result(CommandStateSet, OMX_StateIdle);
+    if(failed(graph.set_state(*init_queue, OMX_StateIdle)))
+      return recover();
 
-    r = OMX_SendCommand (decoder_handle, OMX_CommandStateSet, OMX_StateIdle, null);
-    assert(r == OMX_ErrorNone);
 
+    init_queue->wait();    
 
-    init_queue->add_wait_command_result(CommandStateSet, OMX_StateIdle);
 
-    r = OMX_SendCommand (renderer_handle, OMX_CommandStateSet, OMX_StateIdle, null);
-    assert(r == OMX_ErrorNone);
+    
+    
+    if(failed(graph.disable_tunnel<decode_stage>(*init_queue))
+       || failed(graph.teardown_tunnel<decode_stage>()))
+      return recover();
+
+    init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.out);
+    r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.out, null);
+    if(failed(r))
+      return recover();
+
+    free_renderer_buffers();
 
 
     init_queue->wait();    
+    if(failed())
+      return recover();
 
 
     
-    
-    init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.out);
-    r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.out, null);
-    assert(r == OMX_ErrorNone);
 
-    init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.in);
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.in, null);
-    assert(r == OMX_ErrorNone);
+    destroy_texture_images();
+    release_input();
+  }
 
-    r = OMX_SetupTunnel(decoder_handle, decoder_ports.out
-                        , 0, 0);
-    assert(r == OMX_ErrorNone);
+  void reset_decoded_output()
+  {
+    assert(!!load_queue);
+    assert(!init_queue);
 
-    init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.out);
-    r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.out, null);
-    assert(r == OMX_ErrorNone);
+    OMX_ERRORTYPE r;
+    void* null = 0;
+    init_queue = boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition), boost::ref(arena.init_events), boost::cref(error));
 
-    r = OMX_FreeBuffer (renderer_handle, renderer_ports.out, load_queue->texture_buffer_header);
-    assert(r == OMX_ErrorNone);
+    r = OMX_SendCommand (decoder_handle, OMX_CommandFlush, decoder_ports.in, null);
+    if(failed(r))
+      return recover();
 
+    load_queue->wait_all_buffers();
 
-    init_queue->wait();    
+    init_queue->add_wait_command_result(CommandStateSet, OMX_StateIdle);
+    r = OMX_SendCommand (decoder_handle, OMX_CommandStateSet, OMX_StateIdle, null);
+    if(failed(r))
+      return recover();
 
+    init_queue->wait();
 
-    
+    init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.out);
+    r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.out, null);
+    if(failed(r))
+      return recover();
 
-    eglDestroyImageKHR (*load_queue->eglDisplay, load_queue->texture_mem_handle);
+    free_buffers(decoder_ports.out, output_buffer_headers);
+
+    init_queue->wait();
+    if(failed())
+      return recover();
+
+    release_input();
+  }
+
+  // Disables the decoder input port and puts the decoder back in
+  // Executing for the next load, completion is waited by it, which
+  // fails if these commands did. If they can't be sent the components
+  // are recovered, which gives the input buffers back as well
+  void release_input()
+  {
+    OMX_ERRORTYPE r;
+    void* null = 0;
+
+    observe_input_consumption();
 
-    
     // Assynchronous - Initialization queue
     init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.in);
 
     r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.in, null);
-    assert(r == OMX_ErrorNone);
+    if(failed(r))
+      return recover();
+    free_buffers(decoder_ports.in, buffer_headers);
+    release_input_buffers();
+    r = graph.set_state<decode_stage>(*init_queue, OMX_StateExecuting);
+    if(failed(r))
+      return recover();
+
+    // stop_load looks at it from other threads
+    boost::unique_lock<boost::mutex> l(mutex);
+    load_queue = boost::none;
+  }
 
+  // Input pool shape for the file being loaded, within the decoder's
+  // minimums. Big files get a few large buffers, so the decoder calls
+  // back less often, small ones only what they take. The count
+  // follows whether the decoder ran out of input in earlier loads.
+  // Returns false if the load failed
+  bool shape_input_buffers(std::size_t& count, std::size_t& size, std::size_t& alignment)
+  {
+    OMX_PARAM_PORTDEFINITIONTYPE port;
+    port.nSize = sizeof(port);
+    port.nVersion.nVersion = OMX_VERSION;
+    port.nPortIndex = decoder_ports.in;
+    // Synchronous
+    if(failed(OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port)))
+      return false;
+    if(!input_buffers_wanted)
+      input_buffers_wanted = port.nBufferCountActual;
+
+    std::size_t const page = 4096u, file_size = std::max<std::size_t>(load_queue->file_size, 1u)
+      , minimum_count = std::max<std::size_t>(port.nBufferCountMin, 1u);
+    size = (file_size + input_buffers_wanted - 1) / input_buffers_wanted;
+    size = std::min<std::size_t>(std::max<std::size_t>((size + page - 1) / page * page
+                                                       , min_input_buffer_size)
+                                 , max_input_buffer_size);
+    count = std::min(std::max((file_size + size - 1) / size, minimum_count)
+                     , std::max(input_buffers_wanted, minimum_count));
+    alignment = std::max<std::size_t>(port.nBufferAlignment, sizeof (void*));
+
+    if(port.nBufferCountActual != count || port.nBufferSize != size)
+    {
+      port.nBufferCountActual = count;
+      port.nBufferSize = size;
+      // The decoder may hold to its own sizes, then they are used
+      if(OMX_SetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port) != OMX_ErrorNone)
+      {
+        if(failed(OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port)))
+          return false;
+        count = port.nBufferCountActual;
+        size = std::max<std::size_t>(size, port.nBufferSize);
+      }
+    }
+    return true;
+  }
 
-    for(std::vector<buffer_header>::iterator first = buffer_headers.begin()
-          , last = buffer_headers.end(); first != last; ++first)
-      OMX_FreeBuffer(decoder_handle, decoder_ports.in, first->header);
-    buffer_headers.clear();
+  // Takes the load's input buffers from the process-wide pool, which
+  // reuses the ones another load gave back when they fit the shape.
+  // Returns false if out of memory
+  bool acquire_input_buffers(std::size_t count, std::size_t size, std::size_t alignment)
+  {
+    assert(buffers.empty());
+    input_buffer_pool::buffer b;
+    for(std::size_t i = 0; i != count; ++i)
+    {
+      if(!input_buffer_pool::instance().acquire(size, alignment, b))
+      {
+        release_input_buffers();
+        return false;
+      }
+      buffers.push_back(b);
+    }
+    return true;
+  }
 
-    
-    init_queue->add_wait_command_result(CommandStateSet, OMX_StateExecuting);
-    r = OMX_SendCommand (decoder_handle,  OMX_CommandStateSet, OMX_StateExecuting, null);
-    assert(r == OMX_ErrorNone);
+  // The decoder must not hold them anymore
+  void release_input_buffers()
+  {
+    for(std::vector<input_buffer_pool::buffer>::const_iterator first = buffers.begin()
+          , last = buffers.end(); first != last; ++first)
+      input_buffer_pool::instance().release(*first);
+    buffers.clear();
+  }
 
+  // Asks for one more buffer if the decoder ran out of queued input
+  // during the load, and for one less after a few loads in a row where
+  // it never did, so the count settles on the fewest, largest buffers
+  // that keep the decoder busy
+  void observe_input_consumption()
+  {
+    if(load_queue->starved)
+    {
+      input_buffers_wanted = std::min<std::size_t>(input_buffers_wanted + 1u, max_input_buffers);
+      unstarved_loads = 0u;
+    }
+    else if(++unstarved_loads == std::size_t(loads_before_fewer_buffers))
+    {
+      input_buffers_wanted = std::max<std::size_t>(input_buffers_wanted, 2u) - 1u;
+      unstarved_loads = 0u;
+    }
+  }
 
-    load_queue = boost::none;
+  void free_buffers(int port, std::vector<buffer_header>& headers)
+  {
+    for(std::vector<buffer_header>::iterator first = headers.begin()
+          , last = headers.end(); first != last; ++first)
+      if(first->header)
+        OMX_FreeBuffer(decoder_handle, port, first->header);
+    headers.clear();
   }
-  
-  void decoder_output_port_changed() // Already locked
+
+  void free_renderer_buffers()
   {
+    if(load_queue->texture_buffer_header)
+      OMX_FreeBuffer (renderer_handle, renderer_ports.out, load_queue->texture_buffer_header);
+    load_queue->texture_buffer_header = 0;
+    for(std::vector<ring_slot>::iterator first = ring.begin(), last = ring.end()
+          ; first != last; ++first)
+    {
+      if(first->header)
+        OMX_FreeBuffer (renderer_handle, renderer_ports.out, first->header);
+      first->header = 0;
+    }
+  }
 
-    assert(!!load_queue);
-    load_queue->decoder_output_port_changed = true;
+  // The renderer output port must be disabled
+  void destroy_texture_images()
+  {
+    if(load_queue->eglDisplay && load_queue->texture_mem_handle)
+      eglDestroyImageKHR (*load_queue->eglDisplay, load_queue->texture_mem_handle);
+    load_queue->texture_mem_handle = 0;
+    if(!ring.empty())
+    {
+      for(std::vector<ring_slot>::iterator first = ring.begin(), last = ring.end()
+            ; first != last; ++first)
+        eglDestroyImageKHR (*load_queue->eglDisplay, first->texture_mem_handle);
+      ring.clear();
+      set_renderer_buffer_count(1u);
+    }
   }
 
-  std::size_t buffer_size;
-  std::vector<buffer_header> buffer_headers;
-  std::vector<unsigned char*> buffers;
-  boost::optional<loading_image_queue> load_queue;
+  // Already locked. Records the first error of the load, stops its
+  // output and ends every wait. The load's completion, unless it was
+  // already called, is swapped into f to be called with false once
+  // unlocked.
+  void set_error(OMX_ERRORTYPE e, boost::function<void(bool)>& f)
+  {
+    if(error == OMX_ErrorNone)
+      error = e;
+    if(load_queue)
+    {
+      load_queue->output_complete = true;
+      f.swap(load_queue->callback);
+    }
+    condition.notify_all();
+  }
+
+  // Returns true, failing the load, if r is an error or the load
+  // already failed
+  bool failed(OMX_ERRORTYPE r = OMX_ErrorNone)
+  {
+    boost::function<void(bool)> f;
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      if(r == OMX_ErrorNone && error == OMX_ErrorNone)
+        return false;
+      set_error(r != OMX_ErrorNone ? r : error, f);
+    }
+    if(f)
+      f(false);
+    return true;
+  }
+
+  // Brings the components back to their state between loads after an
+  // error, whatever state it left them in. A component that still
+  // answers is moved to Idle, its ports disabled and its buffers
+  // freed; one that went Invalid or doesn't complete these commands
+  // in time has its handle recreated instead.
+  void recover()
+  {
+    OMX_ERRORTYPE r;
+    void* null = 0;
+    init_queue = boost::in_place<initialization_queue>(boost::ref(mutex), boost::ref(condition), boost::ref(arena.init_events), boost::cref(error));
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue->output_complete = true;
+    }
+
+    bool decoder = stop_component<decode_stage>()
+      , renderer = stop_component<render_stage>();
+
+    if(decoder)
+    {
+      r = OMX_ErrorNone;
+      if(graph.port_enabled<decode_stage>(decoder_ports.in))
+      {
+        init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.in);
+        r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.in, null);
+      }
+      if(r == OMX_ErrorNone && graph.port_enabled<decode_stage>(decoder_ports.out))
+      {
+        init_queue->add_wait_command_result(CommandPortDisable, decoder_ports.out);
+        r = OMX_SendCommand (decoder_handle, OMX_CommandPortDisable, decoder_ports.out, null);
+      }
+      free_buffers(decoder_ports.in, buffer_headers);
+      free_buffers(decoder_ports.out, output_buffer_headers);
+      decoder = r == OMX_ErrorNone && init_queue->timed_wait(recovery_deadline());
+    }
+    if(renderer)
+    {
+      r = OMX_ErrorNone;
+      if(graph.port_enabled<render_stage>(renderer_ports.in))
+      {
+        init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.in);
+        r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.in, null);
+      }
+      if(r == OMX_ErrorNone && graph.port_enabled<render_stage>(renderer_ports.out))
+      {
+        init_queue->add_wait_command_result(CommandPortDisable, renderer_ports.out);
+        r = OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.out, null);
+      }
+      free_renderer_buffers();
+      renderer = r == OMX_ErrorNone && init_queue->timed_wait(recovery_deadline());
+    }
+
+    // The buffers of a recreated component went with its handle
+    buffer_headers.clear();
+    output_buffer_headers.clear();
+    load_queue->texture_buffer_header = 0;
+    if(!decoder)
+    {
+      recreate_component<decode_stage>(decoder_handle);
+      input_coding = OMX_IMAGE_CodingUnused;
+    }
+    release_input_buffers();
+    if(!renderer)
+    {
+      recreate_component<render_stage>(renderer_handle);
+      renderer_transform = image_transform();
+    }
+    graph.teardown_tunnel<decode_stage>();
+    destroy_texture_images();
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      error = OMX_ErrorNone;
+    }
+    // As release_input leaves it
+    failed(graph.set_state<decode_stage>(*init_queue, OMX_StateExecuting));
+    boost::unique_lock<boost::mutex> l(mutex);
+    load_queue = boost::none;
+  }
+
+  // Moves Stage to Idle, which returns its buffers. Returns false if
+  // it is Invalid or doesn't get there in time
+  template <typename Stage>
+  bool stop_component()
+  {
+    OMX_STATETYPE state = graph.state<Stage>();
+    if(state == OMX_StateIdle)
+      return true;
+    if(state != OMX_StateExecuting && state != OMX_StatePause)
+      return false;
+    return graph.set_state<Stage>(*init_queue, OMX_StateIdle) == OMX_ErrorNone
+      && init_queue->timed_wait(recovery_deadline());
+  }
+
+  // A new handle for Stage in Idle with its ports disabled, as the
+  // constructor leaves it. Throws if even that fails
+  template <typename Stage>
+  void recreate_component(OMX_HANDLETYPE& handle)
+  {
+    handle = graph.recreate<Stage>().handle;
+    if(graph.disable_ports<Stage>(*init_queue) != OMX_ErrorNone
+       || graph.set_state<Stage>(*init_queue, OMX_StateIdle) != OMX_ErrorNone
+       || !init_queue->timed_wait(recovery_deadline()))
+      throw std::runtime_error(std::string("Couldn't recover ") + Stage::component_name());
+  }
+  
+  // Enables the decoder input port and feeds it until the decoder
+  // reports its output port settings, which both output paths need
+  // before they can set up the output port. Returns false if the
+  // load failed.
+  bool feed_until_output_port_changed()
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    void* null = 0;
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      if(init_queue)
+      {
+
+        init_queue->wait(l);
+        init_queue = boost::none;
+
+      }
+    }
+    // An error between loads fails this one
+    if(failed())
+      return false;
+
+    // The input port is disabled between loads, so its coding can change
+    OMX_IMAGE_CODINGTYPE coding = input_coding_of(load_queue->header);
+    if(coding != input_coding)
+    {
+      OMX_IMAGE_PARAM_PORTFORMATTYPE image_port_format
+        = detail::make_image_param_portformattype (decoder_ports.in, 0u, coding
+                                                   , OMX_COLOR_FormatUnused);
+      r = OMX_SetParameter (decoder_handle, OMX_IndexParamImagePortFormat, &image_port_format);
+      if(failed(r))
+        return false;
+      input_coding = coding;
+    }
+
+    // We must request it before creating the buffers, but it will only complete
+    // when the buffers are all created
+    load_queue->add_wait_command_result(CommandPortEnable, decoder_ports.in);
+    r = OMX_SendCommand (decoder_handle, OMX_CommandPortEnable, decoder_ports.in, null);
+    if(failed(r))
+      return false;
+
+
+
+    {
+      std::size_t number_buffers, size, alignment;
+      if(!shape_input_buffers(number_buffers, size, alignment))
+        return false;
+      if(!acquire_input_buffers(number_buffers, size, alignment))
+      {
+        failed(OMX_ErrorInsufficientResources);
+        return false;
+      }
+
+      buffer_headers.resize(number_buffers);
+      for (std::size_t i = 0; i != buffer_headers.size(); i++)
+      {
+
+        r = OMX_UseBuffer (decoder_handle, &buffer_headers[i].header
+                           , decoder_ports.in, 0, buffers[i].size
+                           , buffers[i].data);
+
+
+        if(failed(r))
+          return false;
+      }
+    }
+    load_queue->released_buffer_headers = buffer_headers;
+    load_queue->used_buffer_headers.reserve(buffer_headers.size());
+
+    {
+      OMX_PARAM_PORTDEFINITIONTYPE portdef;
+
+      portdef.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+      portdef.nVersion.nVersion = OMX_VERSION;
+      portdef.nPortIndex = decoder_ports.out;
+      r = OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &portdef);
+
+      if(failed(r))
+        return false;
+      // portdef.format.image.eCompressionFormat = OMX_IMAGE_CodingUnused;
+      portdef.format.image.nFrameWidth = 161;
+      portdef.format.image.nFrameHeight = 64;
+      portdef.format.image.nStride = 160;
+      portdef.format.image.nSliceHeight = 64;
+      r = OMX_SetParameter (decoder_handle, OMX_IndexParamPortDefinition, &portdef);
+
+
+      if(failed(r))
+        return false;
+    }
+    return feed_until_settings_changed();
+  }
+
+  // Feeds the open input until the decoder reports the output port
+  // settings of its image. Returns false if the load failed
+  bool feed_until_settings_changed()
+  {
+    OMX_ERRORTYPE r;
+    load_queue->add_wait_command_result(EventPortSettingsChanged
+                                        , decoder_ports.out
+                                        , &image_pipeline::decoder_output_port_changed);
+
+
+    bool decoder_output_port_changed;
+    bool first = true;
+    do
+    {
+
+      load_queue->wait_buffers();
+      if(failed())
+        return false;
+
+      // Assynchronous with buffers AND PortChangedStatus
+      r = OMX_EmptyThisBuffer (decoder_handle, load_queue->fill_buffer(first));
+
+      first = false;
+      if(failed(r))
+        return false;
+      boost::unique_lock<boost::mutex> l(mutex);
+      decoder_output_port_changed = load_queue->decoder_output_port_changed;
+    }
+    while(load_queue->file_offset != load_queue->file_size && !decoder_output_port_changed);
+
+    return true;
+  }
+
+  // Decodes the open input into load_queue's texture, once the
+  // decoder reported its output settings. Between the images of a
+  // batch the renderer is already running and only its output port
+  // is enabled
+  void output_texture(image_transform transform, bool renderer_running)
+  {
+    OMX_ERRORTYPE r;
+    void* null = 0;
+
+    if(transform.exif)
+      transform = image_transform::from_exif_orientation(load_queue->header.orientation);
+
+    int width, height;
+    if(!tunnel_to_renderer(width, height) || !set_renderer_transform(transform))
+      return;
+    if(transform.transposes())
+      std::swap(width, height);
+
+    load_queue->texture_mem_handle = create_texture_image(load_queue->texture_id, width, height);
+
+    if(renderer_running)
+      load_queue->add_wait_command_result(CommandPortEnable, renderer_ports.out);
+    r = OMX_SendCommand (renderer_handle, OMX_CommandPortEnable, renderer_ports.out, null);
+    if(failed(r))
+      return;
+
+    r = OMX_UseEGLImage (renderer_handle, &load_queue->texture_buffer_header
+                         , renderer_ports.out, null, load_queue->texture_mem_handle);
+    if(failed(r))
+      return;
+
+    if(!renderer_running)
+    {
+      load_queue->add_wait_command_result(CommandStateSet, OMX_StateExecuting);
+      r = OMX_SendCommand (renderer_handle,  OMX_CommandStateSet, OMX_StateExecuting, null);
+      if(failed(r))
+        return;
+    }
+
+    load_queue->wait();
+
+
+    if(!feed_remaining_input())
+      return;
+
+
+    
+    r = OMX_FillThisBuffer (renderer_handle, load_queue->texture_buffer_header);
+    failed(r);
+  }
+
+  // The next image of a batch, of the same coding as the one before,
+  // whose texture is complete. Its file follows through the decoder
+  // input port, still enabled with its buffers
+  void load_next_texture(texture_request const& request, image_header const& header
+                         , bool more, boost::function<void(bool)>& f)
+  {
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue->callback.swap(f);
+      load_queue->output_complete = false;
+    }
+    if(!release_texture_output())
+      return;
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue->open_next(request.file, !more);
+      load_queue->header = header;
+      load_queue->texture_id = request.texture_id;
+      load_queue->decoder_output_port_changed = false;
+    }
+    if(feed_until_settings_changed())
+      output_texture(request.transform, true);
+  }
+
+  // Disables the renderer output port and the tunnel, as the first
+  // image of a batch found them, while the components keep
+  // Executing. Returns false if the load failed
+  bool release_texture_output()
+  {
+    void* null = 0;
+    load_queue->add_wait_command_result(CommandPortDisable, renderer_ports.out);
+    if(failed(OMX_SendCommand (renderer_handle, OMX_CommandPortDisable, renderer_ports.out, null)))
+      return false;
+    free_renderer_buffers();
+    if(failed(graph.disable_tunnel<decode_stage>(*load_queue)))
+      return false;
+    load_queue->wait();
+    if(failed())
+      return false;
+    destroy_texture_images();
+    return true;
+  }
+
+  static OMX_IMAGE_CODINGTYPE input_coding_of(image_header const& header)
+  {
+    return header.coding == coding_jpeg ? OMX_IMAGE_CodingJPEG : OMX_IMAGE_CodingPNG;
+  }
+
+  // The input was fed until the decoder reported its output settings
+  // or ran out. A corrupt file may get neither an answer nor an error,
+  // so this waits only a while for them. Returns false if the load
+  // failed
+  bool wait_output_port_changed()
+  {
+    if(load_queue->timed_wait(recovery_deadline()))
+      return true;
+    failed(OMX_ErrorStreamCorrupt);
+    return false;
+  }
+
+  // Tunnels the decoder output to the renderer, once the decoder
+  // reported its output settings, and gets the image dimensions.
+  // Returns false if the load failed.
+  bool tunnel_to_renderer(int& width, int& height)
+  {
+    if(!wait_output_port_changed())
+      return false;
+
+
+    if(failed(graph.setup_tunnel<decode_stage>()))
+      return false;
+
+
+    load_queue->wait();
+
+    
+    if(failed(graph.enable_tunnel<decode_stage>(*load_queue)))
+      return false;
+
+
+    load_queue->wait();
+    if(failed())
+      return false;
+
+
+
+
+    {
+      OMX_PARAM_PORTDEFINITIONTYPE port;
+      port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+      port.nVersion.nVersion = OMX_VERSION;
+      port.nPortIndex = decoder_ports.out;
+      OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port);
+      width = port.format.image.nFrameWidth;
+      height = port.format.image.nFrameHeight;
+
+    }
+    return true;
+  }
+
+  // Replaces an EXIF transform by the one the file's header asks for,
+  // and returns true if it leaves the image as decoded, as the caches
+  // keep it. The header is in header if it had to be probed, for the
+  // load to take
+  static bool untransformed(std::string const& file, image_transform& transform
+                            , boost::optional<image_header>& header)
+  {
+    if(transform.exif)
+    {
+      header = image_header();
+      probe_image_header(file, *header);
+      transform = image_transform::from_exif_orientation(header->orientation);
+    }
+    return transform.identity();
+  }
+
+  // egl_render turns the image as it writes the texture, which keeps
+  // rotated images off the CPU. Returns false if the load failed
+  bool set_renderer_transform(image_transform const& transform)
+  {
+    if(transform == renderer_transform)
+      return true;
+
+    OMX_CONFIG_ROTATIONTYPE rotation;
+    rotation.nSize = sizeof (OMX_CONFIG_ROTATIONTYPE);
+    rotation.nVersion.nVersion = OMX_VERSION;
+    rotation.nPortIndex = renderer_ports.out;
+    rotation.nRotation = transform.rotation;
+    if(failed(OMX_SetConfig (renderer_handle, OMX_IndexConfigCommonRotate, &rotation)))
+      return false;
+
+    OMX_CONFIG_MIRRORTYPE mirror;
+    mirror.nSize = sizeof (OMX_CONFIG_MIRRORTYPE);
+    mirror.nVersion.nVersion = OMX_VERSION;
+    mirror.nPortIndex = renderer_ports.out;
+    mirror.eMirror = transform.mirror ? OMX_MirrorHorizontal : OMX_MirrorNone;
+    if(failed(OMX_SetConfig (renderer_handle, OMX_IndexConfigCommonMirror, &mirror)))
+      return false;
+
+    renderer_transform = transform;
+    return true;
+  }
+
+  void* create_texture_image(int texture_id, int width, int height)
+  {
+    glBindTexture (GL_TEXTURE_2D, texture_id);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, width, height
+                  , 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    return eglCreateImageKHR
+      (*load_queue->eglDisplay, *load_queue->eglContext
+       , EGL_GL_TEXTURE_2D_KHR, (EGLClientBuffer) texture_id, 0);
+  }
+
+  // The renderer output port must be disabled
+  void set_renderer_buffer_count(std::size_t count)
+  {
+    OMX_PARAM_PORTDEFINITIONTYPE port;
+    port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+    port.nVersion.nVersion = OMX_VERSION;
+    port.nPortIndex = renderer_ports.out;
+    OMX_ERRORTYPE r = OMX_GetParameter (renderer_handle, OMX_IndexParamPortDefinition, &port);
+    assert(r == OMX_ErrorNone);
+    if(port.nBufferCountActual != count)
+    {
+      port.nBufferCountActual = count;
+      r = OMX_SetParameter (renderer_handle, OMX_IndexParamPortDefinition, &port);
+      assert(r == OMX_ErrorNone);
+    }
+    static_cast<void>(r);
+  }
+
+  // A renderer output buffer was filled in streaming mode: older
+  // frames nobody acquired are dropped. Already locked
+  std::size_t frame_filled(OMX_BUFFERHEADERTYPE* header)
+  {
+    std::size_t index = reinterpret_cast<std::size_t>(header->pAppPrivate);
+    assert(index < ring.size());
+    for(std::size_t i = 0; i != ring.size(); ++i)
+      if(i != index && ring[i].state == ring_slot::ready)
+      {
+        ring[i].state = ring_slot::with_renderer;
+        ++frames_dropped;
+        OMX_ERRORTYPE r = OMX_FillThisBuffer (renderer_handle, ring[i].header);
+        if(r != OMX_ErrorNone)
+        {
+          boost::function<void(bool)> f;
+          set_error(r, f);
+        }
+      }
+    ring[index].state = ring_slot::ready;
+    ring[index].frame = ++frames_decoded;
+    return index;
+  }
+
+  // Sets the untunneled decoder output port up for the CPU output
+  // paths, once the decoder reported its output settings. Returns
+  // false if the load failed.
+  bool enable_decoder_output()
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    void* null = 0;
+
+    if(!wait_output_port_changed())
+      return false;
+
+    OMX_PARAM_PORTDEFINITIONTYPE port;
+    port.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+    port.nVersion.nVersion = OMX_VERSION;
+    port.nPortIndex = decoder_ports.out;
+    r = OMX_GetParameter (decoder_handle, OMX_IndexParamPortDefinition, &port);
+    if(failed(r))
+      return false;
+
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      load_queue->output_format = port.format.image;
+      decoded_image* image = load_queue->target;
+      if(image && load_queue->planar_output
+         && port.format.image.eColorFormat == OMX_COLOR_FormatYUV420PackedPlanar)
+        detail::begin_yuv_texture(*image, port.format.image.nFrameWidth
+                                  , port.format.image.nFrameHeight);
+      else if(image)
+      {
+        image->width = port.format.image.nFrameWidth;
+        image->height = port.format.image.nFrameHeight;
+        image->stride = image->width * 4;
+        image->format = GL_RGBA;
+        image->type = GL_UNSIGNED_BYTE;
+        image->pixels.resize(image->stride * image->height);
+      }
+    }
+
+    load_queue->add_wait_command_result(CommandPortEnable, decoder_ports.out);
+    r = OMX_SendCommand (decoder_handle, OMX_CommandPortEnable, decoder_ports.out, null);
+    if(failed(r))
+      return false;
+
+    output_buffer_headers.resize(port.nBufferCountActual);
+    for (std::size_t i = 0; i != output_buffer_headers.size(); i++)
+    {
+      r = OMX_AllocateBuffer (decoder_handle, &output_buffer_headers[i].header
+                              , decoder_ports.out, 0, port.nBufferSize);
+      if(failed(r))
+        return false;
+    }
+    load_queue->filled_output.reserve(output_buffer_headers.size());
+
+    load_queue->wait();
+    if(failed())
+      return false;
+
+    for (std::size_t i = 0; i != output_buffer_headers.size(); i++)
+    {
+      r = OMX_FillThisBuffer (decoder_handle, output_buffer_headers[i].header);
+      if(failed(r))
+        return false;
+    }
+    return true;
+  }
+
+  // Deferred CPU output: feeds the input while handing each filled
+  // output buffer to handler on the calling thread, until handler
+  // returns true, the decoder signals end of stream or the load fails.
+  template <typename Handler>
+  void drain_output(Handler& handler)
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+
+    for(;;)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      while(load_queue->filled_output.empty() && error == OMX_ErrorNone
+            && (load_queue->file_offset == load_queue->file_size
+                || load_queue->released_buffer_headers.empty()))
+        condition.wait(l);
+      if(error != OMX_ErrorNone)
+        return;
+
+      if(!load_queue->filled_output.empty())
+      {
+        OMX_BUFFERHEADERTYPE* header = load_queue->filled_output.front();
+        load_queue->filled_output.erase(load_queue->filled_output.begin());
+        l.unlock();
+
+        bool eos = header->nFlags & OMX_BUFFERFLAG_EOS;
+        if(handler(*header) || eos)
+        {
+          l.lock();
+          load_queue->output_complete = true;
+          return;
+        }
+        header->nFilledLen = 0;
+        header->nOffset = 0;
+        r = OMX_FillThisBuffer (decoder_handle, header);
+        if(failed(r))
+          return;
+      }
+      else
+      {
+        l.unlock();
+        r = OMX_EmptyThisBuffer (decoder_handle, load_queue->fill_buffer(false));
+        if(failed(r))
+          return;
+      }
+    }
+  }
+
+  static void ignore_completion(bool) {}
+
+  struct tile_slices
+  {
+    image_pipeline& pipeline;
+    tiled_image& image;
+    unsigned int row;
+
+    bool operator()(OMX_BUFFERHEADERTYPE& header)
+    {
+      OMX_IMAGE_PORTDEFINITIONTYPE const& format = pipeline.load_queue->output_format;
+      unsigned int stride = format.nStride
+        , slice_height = format.nSliceHeight ? format.nSliceHeight : image.height
+        , rows = std::min(slice_height, image.height - row);
+      unsigned char const* slice = header.pBuffer + header.nOffset;
+
+      if(header.nFilledLen && rows)
+      {
+        if(format.eColorFormat == OMX_COLOR_FormatYUV420PackedPlanar)
+        {
+          std::vector<unsigned char>& rgba = pipeline.scratch_image.pixels;
+          rgba.resize(std::size_t(image.width) * 4u * slice_height);
+          detail::yuv420_slice_to_rgba(slice, stride, slice_height, image.width, rows
+                                       , &rgba[0], image.width * 4u);
+          image.add_rows(row, rows, &rgba[0], image.width * 4u);
+        }
+        else
+        {
+          rows = std::min<unsigned int>(rows, header.nFilledLen / stride);
+          image.add_rows(row, rows, slice, stride);
+        }
+        row += rows;
+      }
+      return image.complete() || row >= image.last_row();
+    }
+  };
+
+  // Returns false if the load failed
+  bool feed_remaining_input()
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+
+    while(load_queue->file_offset != load_queue->file_size)
+    {
+
+      load_queue->wait_buffers();
+      if(failed())
+        return false;
+
+
+      r = OMX_EmptyThisBuffer (decoder_handle, load_queue->fill_buffer(false));
+      if(failed(r))
+        return false;
+
+    }
+    return true;
+  }
+  
+  void decoder_output_port_changed() // Already locked
+  {
+
+    assert(!!load_queue);
+    load_queue->decoder_output_port_changed = true;
+  }
+
+  // Decoder input buffers, shaped by shape_input_buffers and only held
+  // during a load
+  enum input_buffer_limits
+  {
+    min_input_buffer_size = 16384
+    , max_input_buffer_size = 1024 * 1024
+    , max_input_buffers = 8
+    , loads_before_fewer_buffers = 4
+  };
+  std::size_t input_buffers_wanted;
+  std::size_t unstarved_loads;
+  std::vector<buffer_header> buffer_headers;
+  std::vector<input_buffer_pool::buffer> buffers;
+  std::vector<buffer_header> output_buffer_headers;
+  boost::optional<loading_image_queue> load_queue;
+  decoded_image_cache* cache;
+  shared_image_cache* shared_cache;
+  bool cached_load;
+  // First error of the load, reset() recovers from it
+  OMX_ERRORTYPE error;
+  decoded_image scratch_image;
+  OMX_IMAGE_CODINGTYPE input_coding;
+  // Configured on egl_render, kept across loads
+  image_transform renderer_transform;
+
+  // Streaming mode output textures
+  struct ring_slot
+  {
+    enum slot_state { with_renderer, ready, acquired };
+
+    int texture_id;
+    void* texture_mem_handle;
+    OMX_BUFFERHEADERTYPE* header;
+    slot_state state;
+    unsigned long frame;
+  };
+  std::vector<ring_slot> ring;
+  boost::function<void(std::size_t)> frame_ready;
+  unsigned long frames_decoded, frames_dropped;
 
   struct ports
   {
@@ -830,6 +2258,8 @@ struct image_pipeline
     int out;
   };
   
+  typedef omx_graph<boost::mpl::vector<decode_stage, render_stage> > graph_type;
+  graph_type graph;
   OMX_HANDLETYPE decoder_handle, renderer_handle;
   ports decoder_ports, renderer_ports;
 };
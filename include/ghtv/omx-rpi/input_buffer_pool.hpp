@@ -0,0 +1,193 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_INPUT_BUFFER_POOL_HPP
+#define GHTV_OMX_RPI_INPUT_BUFFER_POOL_HPP
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/bind.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+namespace ghtv { namespace omx_rpi {
+
+// Decoder input buffers, shared by every pipeline of the process, and
+// the image_encoder's buffers. A pipeline takes its buffers for a load
+// and gives them back when it is reset, so idle pipelines hold none. Idle buffers are kept for
+// the next load up to the high watermark, then freed down to the low
+// one, and freed anyway once idle for longer than the idle timeout.
+struct input_buffer_pool : boost::noncopyable
+{
+  struct buffer
+  {
+    unsigned char* data;
+    std::size_t size;
+  };
+
+  static input_buffer_pool& instance()
+  {
+    static input_buffer_pool pool;
+    return pool;
+  }
+
+  input_buffer_pool()
+    : high_watermark(4u * 1024u * 1024u), low_watermark(1024u * 1024u)
+    , idle_timeout(boost::posix_time::seconds(5)), idle_size(0u), stopping(false)
+  {
+    idle.reserve(16u);
+    reaper = boost::thread(boost::bind(&input_buffer_pool::reap, this));
+  }
+
+  ~input_buffer_pool()
+  {
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      stopping = true;
+      condition.notify_one();
+    }
+    reaper.join();
+    free_idle(0u);
+  }
+
+  // An idle buffer of at least size bytes, but not so much bigger it
+  // would waste most of it, or a new one. Returns false if out of
+  // memory, even after freeing the idle buffers
+  bool acquire(std::size_t size, std::size_t alignment, buffer& b)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    std::vector<idle_buffer>::iterator best = idle.end();
+    for(std::vector<idle_buffer>::iterator first = idle.begin(), last = idle.end()
+          ; first != last; ++first)
+      if(first->b.size >= size && first->b.size <= 4u * size
+         && reinterpret_cast<std::size_t>(first->b.data) % alignment == 0u
+         && (best == idle.end() || first->b.size < best->b.size))
+        best = first;
+    if(best != idle.end())
+    {
+      b = best->b;
+      idle_size -= b.size;
+      idle.erase(best);
+      return true;
+    }
+
+    b.size = size;
+    if(!posix_memalign(reinterpret_cast<void**>(&b.data), alignment, size))
+      return true;
+    free_idle(0u);
+    return !posix_memalign(reinterpret_cast<void**>(&b.data), alignment, size);
+  }
+
+  void release(buffer const& b)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    idle_buffer i = {b, boost::get_system_time()};
+    idle.push_back(i);
+    idle_size += b.size;
+    if(idle_size > high_watermark)
+      free_idle(low_watermark);
+    condition.notify_one();
+  }
+
+  void set_watermarks(std::size_t high, std::size_t low)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    high_watermark = high;
+    low_watermark = std::min(low, high);
+    if(idle_size > high_watermark)
+      free_idle(low_watermark);
+  }
+
+  void set_idle_timeout(boost::posix_time::time_duration timeout)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    idle_timeout = timeout;
+    condition.notify_one();
+  }
+
+  // Frees every idle buffer now
+  void trim()
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    free_idle(0u);
+  }
+
+  std::size_t idle_bytes() const
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    return idle_size;
+  }
+private:
+  struct idle_buffer
+  {
+    buffer b;
+    boost::system_time since;
+  };
+
+  // Already locked. Frees the buffers idle the longest, which come
+  // first, until no more than size bytes are idle
+  void free_idle(std::size_t size)
+  {
+    std::vector<idle_buffer>::iterator first = idle.begin();
+    for(; first != idle.end() && idle_size > size; ++first)
+    {
+      std::free(first->b.data);
+      idle_size -= first->b.size;
+    }
+    idle.erase(idle.begin(), first);
+  }
+
+  // Frees buffers as their idle timeout expires
+  void reap()
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    while(!stopping)
+    {
+      if(idle.empty())
+      {
+        condition.wait(l);
+        continue;
+      }
+      boost::system_time expiry = idle.front().since + idle_timeout;
+      if(boost::get_system_time() < expiry)
+      {
+        condition.timed_wait(l, expiry);
+        continue;
+      }
+      std::free(idle.front().b.data);
+      idle_size -= idle.front().b.size;
+      idle.erase(idle.begin());
+    }
+  }
+
+  std::size_t high_watermark, low_watermark;
+  boost::posix_time::time_duration idle_timeout;
+  std::vector<idle_buffer> idle;
+  std::size_t idle_size;
+  mutable boost::mutex mutex;
+  boost::condition_variable condition;
+  bool stopping;
+  boost::thread reaper;
+};
+
+} }
+
+#endif
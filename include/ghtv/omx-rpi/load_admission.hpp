@@ -0,0 +1,169 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_LOAD_ADMISSION_HPP
+#define GHTV_OMX_RPI_LOAD_ADMISSION_HPP
+
+#include <ghtv/omx-rpi/image_header.hpp>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/cstdint.hpp>
+
+#include <algorithm>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ghtv { namespace omx_rpi {
+
+// Memory a load of path takes while in flight: the RGBA texture or
+// decoded pixels, from the header's dimensions, and the decoder input
+// buffers, which take at most 8MB. A file whose header can't be read
+// counts for its input only
+inline std::size_t estimate_load_cost(std::string const& path)
+{
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if(fd < 0)
+    return 0u;
+  struct stat st;
+  std::size_t input = ::fstat(fd, &st) == 0 ? st.st_size : 0u;
+  image_header header;
+  bool probed = probe_image_header(fd, header);
+  ::close(fd);
+  std::size_t pixels = probed ? std::size_t(header.width) * header.height * 4u : 0u;
+  return pixels + std::min<std::size_t>(input, 8u * 1024u * 1024u);
+}
+
+// Limits the memory the loads in flight take together, across every
+// loader of the process, so a burst of large images doesn't exhaust
+// the GPU memory split. A load is admitted when its cost fits in
+// what the others left of the budget, in the order they asked;
+// the rest wait. A load costing more than the whole budget is
+// admitted alone. A budget of 0 admits everything.
+struct load_admission : boost::noncopyable
+{
+  struct metrics
+  {
+    // Loads waiting for admission now, and the most there were
+    std::size_t queued;
+    std::size_t peak_queued;
+    std::size_t in_flight_cost;
+    boost::uint64_t admitted;
+    // Of the admitted loads, how many waited and for how long in all
+    boost::uint64_t blocked;
+    boost::posix_time::time_duration blocked_time;
+  };
+
+  // Holds an admission until destroyed
+  struct reservation : boost::noncopyable
+  {
+    reservation(load_admission& admission, std::size_t cost)
+      : admission(admission), cost(admission.admit(cost))
+    {}
+    ~reservation()
+    {
+      admission.release(cost);
+    }
+  private:
+    load_admission& admission;
+    std::size_t cost;
+  };
+
+  static load_admission& instance()
+  {
+    static load_admission admission;
+    return admission;
+  }
+
+  load_admission(std::size_t budget = 32u * 1024u * 1024u)
+    : budget(budget), in_flight(0u), next_ticket(0u), serving(0u)
+  {
+    m.queued = m.peak_queued = m.in_flight_cost = 0u;
+    m.admitted = m.blocked = 0u;
+  }
+
+  // Blocks until cost fits and returns what was reserved, to be given
+  // back to release
+  std::size_t admit(std::size_t cost)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    boost::uint64_t ticket = next_ticket++;
+    if(!fits(ticket, cost))
+    {
+      boost::system_time start = boost::get_system_time();
+      m.peak_queued = (std::max)(m.peak_queued, ++m.queued);
+      do
+        condition.wait(l);
+      while(!fits(ticket, cost));
+      --m.queued;
+      ++m.blocked;
+      m.blocked_time += boost::get_system_time() - start;
+    }
+    ++serving;
+    ++m.admitted;
+    in_flight += cost;
+    m.in_flight_cost = in_flight;
+    condition.notify_all();
+    return cost;
+  }
+
+  void release(std::size_t cost)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    in_flight -= cost;
+    m.in_flight_cost = in_flight;
+    condition.notify_all();
+  }
+
+  // Applies to the loads waiting as well
+  void set_budget(std::size_t b)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    budget = b;
+    condition.notify_all();
+  }
+
+  metrics get_metrics() const
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    return m;
+  }
+private:
+  // Already locked. Only the oldest waiting load may be admitted, so
+  // small loads don't starve a large one
+  bool fits(boost::uint64_t ticket, std::size_t cost) const
+  {
+    return ticket == serving
+      && (!budget || !in_flight || in_flight + cost <= budget);
+  }
+
+  std::size_t budget;
+  std::size_t in_flight;
+  boost::uint64_t next_ticket, serving;
+  metrics m;
+  mutable boost::mutex mutex;
+  boost::condition_variable condition;
+};
+
+} }
+
+#endif
@@ -0,0 +1,119 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_MIPMAP_HPP
+#define GHTV_OMX_RPI_MIPMAP_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <vector>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+namespace detail {
+
+// Dimension of the next mip level, as GL sizes them
+inline unsigned int half_dimension(unsigned int d)
+{
+  return d > 1u ? d / 2u : 1u;
+}
+
+// The next mip level of a width by height level, with a 2x2 box filter
+// over each channel. The last row or column of an odd dimension is
+// dropped, a dimension of 1 is filtered along the other one only. out
+// is tightly packed. The inner loop is over bytes of the same channel
+// so the compiler can vectorize it.
+inline void box_filter_half(unsigned char const* in, unsigned int in_stride
+                            , unsigned int width, unsigned int height
+                            , unsigned int bytes_per_pixel, unsigned char* out)
+{
+  unsigned int out_width = half_dimension(width), out_height = half_dimension(height)
+    , step_x = width > 1u ? bytes_per_pixel : 0u, step_y = height > 1u ? in_stride : 0u
+    , row_size = out_width * bytes_per_pixel;
+  for(unsigned int y = 0; y != out_height; ++y)
+  {
+    unsigned char const* top = in + 2u * y * in_stride;
+    unsigned char const* bottom = top + step_y;
+    unsigned char* o = out + y * row_size;
+    for(unsigned int x = 0; x != out_width; ++x)
+    {
+      unsigned int i = (width > 1u ? 2u * x : x) * bytes_per_pixel;
+      for(unsigned int c = 0; c != bytes_per_pixel; ++c)
+        o[x * bytes_per_pixel + c] = (top[i + c] + top[i + step_x + c]
+                                      + bottom[i + c] + bottom[i + step_x + c] + 2u) >> 2;
+    }
+  }
+}
+
+inline unsigned int bytes_per_pixel(GLenum format)
+{
+  switch(format)
+  {
+  case GL_LUMINANCE: case GL_ALPHA: return 1u;
+  case GL_LUMINANCE_ALPHA: return 2u;
+  case GL_RGB: return 3u;
+  default: return 4u;
+  }
+}
+
+inline GLint unpack_alignment(unsigned int stride)
+{
+  return stride % 8 == 0 ? 8 : stride % 4 == 0 ? 4 : 1;
+}
+
+}
+
+// Uploads image with its whole mip chain, down to 1x1, filtered on the
+// CPU instead of by glGenerateMipmap on the caller's thread, and
+// samples it with GL_LINEAR_MIPMAP_LINEAR. Only for uncompressed
+// images of unsigned bytes; non power of two dimensions need
+// OES_texture_npot. Must be called with a current EGL context
+inline void upload_mipmapped_texture(GLuint texture_id, decoded_image const& image)
+{
+  assert(image.format != GL_ETC1_RGB8_OES && image.type == GL_UNSIGNED_BYTE);
+  upload_texture(texture_id, image);
+  glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+  if(image.pixels.empty())
+    return;
+
+  unsigned int const bytes = detail::bytes_per_pixel(image.format);
+  unsigned int width = image.width, height = image.height, stride = image.stride;
+  // Levels alternate between two buffers, sized for the first level
+  // each holds as the ones after are smaller
+  std::vector<unsigned char> levels[2];
+  unsigned int w = detail::half_dimension(width), h = detail::half_dimension(height);
+  levels[0].resize(std::size_t(w) * h * bytes);
+  levels[1].resize(std::size_t(detail::half_dimension(w)) * detail::half_dimension(h) * bytes);
+  unsigned char const* in = &image.pixels[0];
+  for(GLint level = 1; width > 1u || height > 1u; ++level)
+  {
+    unsigned char* out = &levels[(level - 1) % 2][0];
+    detail::box_filter_half(in, stride, width, height, bytes, out);
+    width = detail::half_dimension(width);
+    height = detail::half_dimension(height);
+    stride = width * bytes;
+    glPixelStorei(GL_UNPACK_ALIGNMENT, detail::unpack_alignment(stride));
+    glTexImage2D (GL_TEXTURE_2D, level, image.format, width, height, 0, image.format, image.type, out);
+    in = out;
+  }
+}
+
+} }
+
+#endif
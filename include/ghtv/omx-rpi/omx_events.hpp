@@ -0,0 +1,207 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_OMX_EVENTS_HPP
+#define GHTV_OMX_RPI_OMX_EVENTS_HPP
+
+#include <IL/OMX_Broadcom.h>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread_time.hpp>
+
+#include <vector>
+
+namespace ghtv { namespace omx_rpi { namespace detail {
+
+// Tags selecting which event to wait for
+namespace omx_commands {
+
+struct CommandPortDisable_type {};
+struct CommandPortEnable_type {};
+struct CommandStateSet_type {};
+struct EventPortSettingsChanged_type {};
+
+}
+
+// Waiting for OMX events, shared by the objects that drive OMX
+// components. Owner's event handler calls complete_event for each
+// event it gets; the waiting thread blocks until its list is empty,
+// or until the owner records an error, which ends every wait.
+template <typename Owner>
+struct omx_events
+{
+  typedef omx_commands::CommandPortDisable_type CommandPortDisable_type;
+  typedef omx_commands::CommandPortEnable_type CommandPortEnable_type;
+  typedef omx_commands::CommandStateSet_type CommandStateSet_type;
+  typedef omx_commands::EventPortSettingsChanged_type EventPortSettingsChanged_type;
+  CommandPortDisable_type CommandPortDisable;
+  CommandPortEnable_type CommandPortEnable;
+  CommandStateSet_type CommandStateSet;
+  EventPortSettingsChanged_type EventPortSettingsChanged;
+
+  // How long recovering from an error waits for a component before
+  // recreating it
+  static boost::system_time recovery_deadline()
+  {
+    return boost::get_system_time() + boost::posix_time::milliseconds(100);
+  }
+
+  struct wait_event
+  {
+    OMX_EVENTTYPE event;
+    unsigned int nData1;
+    unsigned int nData2;
+    void (Owner::* callback)();
+  };
+
+  struct wait_functions
+  {
+    static void add_event_result
+      (boost::mutex& mutex, std::vector<wait_event>& events, CommandPortDisable_type, int p
+       , void (Owner::* callback)() = 0)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      wait_event e = {OMX_EventCmdComplete, OMX_CommandPortDisable, (unsigned int)p, callback};
+      events.push_back(e);
+    }
+
+    static void add_event_result
+      (boost::mutex& mutex, std::vector<wait_event>& events, CommandPortEnable_type, int p
+       , void (Owner::* callback)() = 0)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      wait_event e = {OMX_EventCmdComplete, OMX_CommandPortEnable, (unsigned int)p, callback};
+      events.push_back(e);
+    }
+
+    static void add_event_result
+      (boost::mutex& mutex, std::vector<wait_event>& events, CommandStateSet_type, OMX_STATETYPE s
+       , void (Owner::* callback)() = 0)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      wait_event e = {OMX_EventCmdComplete, OMX_CommandStateSet, s, callback};
+      events.push_back(e);
+    }
+    static void add_event_result(boost::mutex& mutex, std::vector<wait_event>& events
+                                 , EventPortSettingsChanged_type c, int port
+                                 , void (Owner::* callback)() = 0)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      wait_event e = {OMX_EventPortSettingsChanged, (unsigned int)port, 0u, callback};
+      events.push_back(e);
+    }
+
+    // Returns false if an error ended the wait
+    static bool wait(boost::mutex& mutex, boost::unique_lock<boost::mutex>& l
+                     , boost::condition_variable& condition
+                     , std::vector<wait_event>& events, OMX_ERRORTYPE const& error)
+    {
+
+      while(!events.empty() && error == OMX_ErrorNone)
+      {
+        condition.wait(l);
+      }
+      return error == OMX_ErrorNone;
+    }
+
+    // Used while recovering from an error, so errors don't end it.
+    // Returns false, forgetting the events, if they didn't all
+    // complete by deadline
+    static bool timed_wait(boost::unique_lock<boost::mutex>& l
+                           , boost::condition_variable& condition
+                           , std::vector<wait_event>& events
+                           , boost::system_time const& deadline)
+    {
+      while(!events.empty())
+        if(!condition.timed_wait(l, deadline))
+          break;
+      bool completed = events.empty();
+      events.clear();
+      return completed;
+    }
+
+    // Called with mutex locked. Removes the event from events, calling
+    // its callback, and returns true if it was the last one awaited
+    static bool complete_event(Owner* self, std::vector<wait_event>& events
+                               , OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2)
+    {
+      typename std::vector<wait_event>::iterator
+        first = events.begin()
+        , last = events.end();
+      while(first != last && (first->event != eEvent || first->nData1 != nData1 || first->nData2 != nData2))
+        ++first;
+      if(first == last)
+        return false;
+
+      if(first->callback)
+        (self ->* first->callback)();
+      events.erase(first);
+      return events.empty();
+    }
+  };
+
+  struct initialization_queue
+  {
+    boost::mutex& mutex;
+    boost::condition_variable& condition;
+    // Owned by the caller, so its capacity outlives the queue
+    std::vector<wait_event>& events;
+    OMX_ERRORTYPE const& error;
+
+    initialization_queue(boost::mutex& m, boost::condition_variable& c
+                         , std::vector<wait_event>& e, OMX_ERRORTYPE const& error)
+      : mutex(m), condition(c), events(e), error(error)
+    {
+      // Left over by a wait an error ended
+      events.clear();
+    }
+
+    void add_wait_command_result(CommandPortDisable_type c, int p)
+    {
+      wait_functions::add_event_result(mutex, events, c, p);
+    }
+
+    void add_wait_command_result(CommandPortEnable_type c, int p)
+    {
+      wait_functions::add_event_result(mutex, events, c, p);
+    }
+
+    void add_wait_command_result(CommandStateSet_type c, OMX_STATETYPE s)
+    {
+      wait_functions::add_event_result(mutex, events, c, s);
+    }
+
+    bool wait(boost::unique_lock<boost::mutex>& l)
+    {
+      return wait_functions::wait(mutex, l, condition, events, error);
+    }
+    bool wait()
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      return wait(l);
+    }
+    bool timed_wait(boost::system_time const& deadline)
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      return wait_functions::timed_wait(l, condition, events, deadline);
+    }
+  };
+};
+
+} } }
+
+#endif
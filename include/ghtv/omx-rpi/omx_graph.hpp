@@ -0,0 +1,365 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_OMX_GRAPH_HPP
+#define GHTV_OMX_RPI_OMX_GRAPH_HPP
+
+#include <IL/OMX_Broadcom.h>
+
+#include <ghtv/omx-rpi/omx_events.hpp>
+#include <ghtv/omx-rpi/omx_trace.hpp>
+
+#include <boost/mpl/begin_end.hpp>
+#include <boost/mpl/next.hpp>
+#include <boost/mpl/deref.hpp>
+#include <boost/mpl/find.hpp>
+#include <boost/mpl/distance.hpp>
+#include <boost/mpl/size.hpp>
+#include <boost/mpl/empty.hpp>
+#include <boost/mpl/for_each.hpp>
+#include <boost/mpl/assert.hpp>
+#include <boost/mpl/vector.hpp>
+#include <boost/type_traits/is_same.hpp>
+#include <boost/array.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <stdexcept>
+#include <string>
+
+namespace ghtv { namespace omx_rpi {
+
+// What flows through a port. A tunnel only connects an output port to
+// an input port of the same kind.
+struct compressed_image_port {};
+struct raw_image_port {};
+struct egl_image_port {};
+
+// Stages of an omx_graph, each one an OMX component with one input
+// and one output port
+struct decode_stage
+{
+  typedef compressed_image_port input_port;
+  typedef raw_image_port output_port;
+  static char const* component_name() { return "OMX.broadcom.image_decode"; }
+  static OMX_INDEXTYPE port_init_index() { return OMX_IndexParamImageInit; }
+};
+
+struct resize_stage
+{
+  typedef raw_image_port input_port;
+  typedef raw_image_port output_port;
+  static char const* component_name() { return "OMX.broadcom.resize"; }
+  static OMX_INDEXTYPE port_init_index() { return OMX_IndexParamImageInit; }
+};
+
+struct render_stage
+{
+  typedef raw_image_port input_port;
+  typedef egl_image_port output_port;
+  static char const* component_name() { return "OMX.broadcom.egl_render"; }
+  static OMX_INDEXTYPE port_init_index() { return OMX_IndexParamVideoInit; }
+};
+
+struct encode_stage
+{
+  typedef raw_image_port input_port;
+  typedef compressed_image_port output_port;
+  static char const* component_name() { return "OMX.broadcom.image_encode"; }
+  static OMX_INDEXTYPE port_init_index() { return OMX_IndexParamImageInit; }
+};
+
+namespace detail {
+
+// Fails to compile unless every stage's output port can be tunneled
+// to the next stage's input port
+template <typename First, typename Last
+          , typename Next = typename boost::mpl::next<First>::type>
+struct check_tunnels
+{
+  typedef typename boost::mpl::deref<First>::type from;
+  typedef typename boost::mpl::deref<Next>::type to;
+  BOOST_MPL_ASSERT_MSG((boost::is_same<typename from::output_port, typename to::input_port>::value)
+                       , TUNNEL_BETWEEN_PORTS_OF_DIFFERENT_KINDS, (from, to));
+  typedef typename check_tunnels<Next, Last>::type type;
+};
+
+template <typename First, typename Last>
+struct check_tunnels<First, Last, Last>
+{
+  typedef void type;
+};
+
+}
+
+// A chain of OMX components described by an MPL sequence of stages,
+// each tunneled to the next. It gets the handles, finds the ports and
+// issues the command sequences for all components at once: each
+// command's completion is added to the queue before it is sent, and
+// the caller waits for all of them together. Commands return the
+// first error OMX reported sending them. With a trace, the handles
+// are got through it, to record or replay the components.
+template <typename Stages>
+struct omx_graph : boost::noncopyable
+{
+  BOOST_MPL_ASSERT_NOT((boost::mpl::empty<Stages>));
+  typedef typename detail::check_tunnels
+  <typename boost::mpl::begin<Stages>::type
+   , typename boost::mpl::end<Stages>::type>::type tunnels_checked;
+
+  struct component
+  {
+    OMX_HANDLETYPE handle;
+    int in;
+    int out;
+  };
+
+  omx_graph(OMX_PTR app_data, OMX_CALLBACKTYPE callbacks, omx_trace* trace = 0)
+    : app_data(app_data), callbacks(callbacks), trace(trace)
+  {
+    // Synchronous
+    if(trace)
+      trace->init();
+    else
+      detail::omx_core::init();
+
+    std::size_t index = 0u;
+    get_handle f = {components.begin(), &index, app_data, &this->callbacks, trace};
+    boost::mpl::for_each<Stages>(f);
+  }
+
+  template <typename Stage>
+  component& get()
+  {
+    return components[index_of<Stage>::value];
+  }
+
+  // The stage Stage is tunneled to
+  template <typename Stage>
+  component& next()
+  {
+    BOOST_MPL_ASSERT_RELATION(index_of<Stage>::value + 1u, <, boost::mpl::size<Stages>::value);
+    return components[index_of<Stage>::value + 1u];
+  }
+
+  // Disables every port of every component
+  template <typename Queue>
+  OMX_ERRORTYPE disable_ports(Queue& queue)
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    for(typename boost::array<component, size>::iterator first = components.begin()
+          ; first != components.end(); ++first)
+      r = first_error(r, disable_ports(queue, *first));
+    return r;
+  }
+
+  template <typename Stage, typename Queue>
+  OMX_ERRORTYPE disable_ports(Queue& queue)
+  {
+    return disable_ports(queue, get<Stage>());
+  }
+
+  // Moves every component to state
+  template <typename Queue>
+  OMX_ERRORTYPE set_state(Queue& queue, OMX_STATETYPE state)
+  {
+    OMX_ERRORTYPE r = OMX_ErrorNone;
+    for(typename boost::array<component, size>::iterator first = components.begin()
+          ; first != components.end(); ++first)
+      r = first_error(r, set_state(queue, *first, state));
+    return r;
+  }
+
+  template <typename Stage, typename Queue>
+  OMX_ERRORTYPE set_state(Queue& queue, OMX_STATETYPE state)
+  {
+    return set_state(queue, get<Stage>(), state);
+  }
+
+  // Tunnels From's output to the next stage's input, both ports must
+  // be disabled
+  template <typename From>
+  OMX_ERRORTYPE setup_tunnel()
+  {
+    component &from = get<From>(), &to = next<From>();
+    return setup_tunnel(from.handle, from.out, to.handle, to.in);
+  }
+
+  // Both ends, either may have been recreated since the tunnel was
+  // set up
+  template <typename From>
+  OMX_ERRORTYPE teardown_tunnel()
+  {
+    component &from = get<From>(), &to = next<From>();
+    return first_error(setup_tunnel(from.handle, from.out, 0, 0)
+                       , setup_tunnel(to.handle, to.in, 0, 0));
+  }
+
+  // Enables or disables both ends of the tunnel from From
+  template <typename From, typename Queue>
+  OMX_ERRORTYPE enable_tunnel(Queue& queue)
+  {
+    component &from = get<From>(), &to = next<From>();
+    return first_error(send_command(queue, from, OMX_CommandPortEnable, port_enable(), from.out)
+                       , send_command(queue, to, OMX_CommandPortEnable, port_enable(), to.in));
+  }
+
+  template <typename From, typename Queue>
+  OMX_ERRORTYPE disable_tunnel(Queue& queue)
+  {
+    component &from = get<From>(), &to = next<From>();
+    return first_error(send_command(queue, from, OMX_CommandPortDisable, port_disable(), from.out)
+                       , send_command(queue, to, OMX_CommandPortDisable, port_disable(), to.in));
+  }
+
+  // OMX_StateInvalid if the component can't even tell
+  template <typename Stage>
+  OMX_STATETYPE state()
+  {
+    OMX_STATETYPE state;
+    if(OMX_GetState (get<Stage>().handle, &state) != OMX_ErrorNone)
+      state = OMX_StateInvalid;
+    return state;
+  }
+
+  template <typename Stage>
+  bool port_enabled(int port)
+  {
+    OMX_PARAM_PORTDEFINITIONTYPE definition;
+    definition.nSize = sizeof (OMX_PARAM_PORTDEFINITIONTYPE);
+    definition.nVersion.nVersion = OMX_VERSION;
+    definition.nPortIndex = port;
+    return OMX_GetParameter (get<Stage>().handle, OMX_IndexParamPortDefinition, &definition)
+      == OMX_ErrorNone && definition.bEnabled;
+  }
+
+  // Frees Stage's handle and gets a new one, in Loaded with its ports
+  // enabled. For a component that went Invalid or stopped completing
+  // its commands, its buffers and tunnels are gone with it
+  template <typename Stage>
+  component& recreate()
+  {
+    component& c = get<Stage>();
+    free_handle(c.handle);
+    std::size_t index = 0u;
+    get_handle f = {&c, &index, app_data, &callbacks, trace};
+    f(Stage());
+    return c;
+  }
+
+  // The components must be back in Loaded
+  void free_handles()
+  {
+    for(typename boost::array<component, size>::iterator first = components.begin()
+          ; first != components.end(); ++first)
+      free_handle(first->handle);
+  }
+
+  static std::size_t const size = boost::mpl::size<Stages>::value;
+private:
+  typedef detail::omx_commands::CommandPortEnable_type port_enable;
+  typedef detail::omx_commands::CommandPortDisable_type port_disable;
+
+  template <typename Stage>
+  struct index_of
+  {
+    typedef typename boost::mpl::find<Stages, Stage>::type position;
+    BOOST_MPL_ASSERT_NOT((boost::is_same<position, typename boost::mpl::end<Stages>::type>));
+    static std::size_t const value = boost::mpl::distance
+      <typename boost::mpl::begin<Stages>::type, position>::value;
+  };
+
+  struct get_handle
+  {
+    component* components;
+    std::size_t* index;
+    OMX_PTR app_data;
+    OMX_CALLBACKTYPE* callbacks;
+    omx_trace* trace;
+
+    template <typename Stage>
+    void operator()(Stage) const
+    {
+      component& c = components[(*index)++];
+      OMX_ERRORTYPE r = trace
+        ? trace->get_handle(&c.handle, Stage::component_name(), app_data, callbacks)
+        : detail::omx_core::get_handle(&c.handle, Stage::component_name(), app_data, callbacks);
+      if(r != OMX_ErrorNone)
+        throw std::runtime_error(std::string("Couldn't get a handle for ") + Stage::component_name());
+
+      OMX_PORT_PARAM_TYPE port;
+      port.nSize = sizeof (OMX_PORT_PARAM_TYPE);
+      port.nVersion.nVersion = OMX_VERSION;
+      // Synchronous
+      r = OMX_GetParameter (c.handle, Stage::port_init_index(), &port);
+      if(r != OMX_ErrorNone)
+        throw std::runtime_error(std::string("Couldn't find the ports of ") + Stage::component_name());
+      c.in = port.nStartPortNumber;
+      c.out = port.nStartPortNumber + 1;
+    }
+  };
+
+  OMX_ERRORTYPE setup_tunnel(OMX_HANDLETYPE out, int out_port, OMX_HANDLETYPE in, int in_port)
+  {
+    return trace ? trace->setup_tunnel(out, out_port, in, in_port)
+      : detail::omx_core::setup_tunnel(out, out_port, in, in_port);
+  }
+
+  void free_handle(OMX_HANDLETYPE handle)
+  {
+    if(trace)
+      trace->free_handle(handle);
+    else
+      detail::omx_core::free_handle(handle);
+  }
+
+  static OMX_ERRORTYPE first_error(OMX_ERRORTYPE r, OMX_ERRORTYPE next)
+  {
+    return r != OMX_ErrorNone ? r : next;
+  }
+
+  template <typename Queue, typename Command>
+  static OMX_ERRORTYPE send_command(Queue& queue, component& c, OMX_COMMANDTYPE command
+                                    , Command wait, int port)
+  {
+    queue.add_wait_command_result(wait, port);
+    void* null = 0;
+    return OMX_SendCommand (c.handle, command, port, null);
+  }
+
+  template <typename Queue>
+  static OMX_ERRORTYPE disable_ports(Queue& queue, component& c)
+  {
+    return first_error(send_command(queue, c, OMX_CommandPortDisable, port_disable(), c.in)
+                       , send_command(queue, c, OMX_CommandPortDisable, port_disable(), c.out));
+  }
+
+  template <typename Queue>
+  static OMX_ERRORTYPE set_state(Queue& queue, component& c, OMX_STATETYPE state)
+  {
+    queue.add_wait_command_result(detail::omx_commands::CommandStateSet_type(), state);
+    void* null = 0;
+    return OMX_SendCommand (c.handle, OMX_CommandStateSet, state, null);
+  }
+
+  OMX_PTR app_data;
+  OMX_CALLBACKTYPE callbacks;
+  omx_trace* trace;
+  boost::array<component, boost::mpl::size<Stages>::value> components;
+};
+
+} }
+
+#endif
@@ -0,0 +1,816 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_OMX_TRACE_HPP
+#define GHTV_OMX_RPI_OMX_TRACE_HPP
+
+#include <IL/OMX_Broadcom.h>
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <vector>
+#include <map>
+#include <queue>
+#include <deque>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+#include <cstring>
+
+#include <time.h>
+
+namespace ghtv { namespace omx_rpi {
+
+// One entry of a trace log: an OMX call the application made, or a
+// callback a component made. The log is these records in the order
+// they happened, each followed by payload bytes, in the byte order of
+// the machine that recorded it.
+struct omx_trace_record
+{
+  enum record_kind
+  {
+    send_command, get_parameter, set_parameter, get_config, set_config
+    , get_state, use_buffer, allocate_buffer, use_egl_image, free_buffer
+    , empty_this_buffer, fill_this_buffer, setup_tunnel
+    , event, empty_buffer_done, fill_buffer_done
+  };
+
+  // Microseconds since the trace started
+  boost::uint64_t time;
+  // Callbacks: the call record they answer, no_cause if unknown
+  boost::uint32_t cause;
+  // Calls: microseconds they took
+  boost::uint32_t duration;
+  // Calls: their arguments and the error they returned. Buffers are
+  // numbered per component as they are created, reusing the numbers of
+  // freed ones.
+  //   send_command            command, param, error
+  //   get_/set_parameter,
+  //   get_/set_config         index, 0, error; the get_ ones have the
+  //                           structure as payload
+  //   get_state               state, 0, error
+  //   use_/allocate_buffer,
+  //   use_egl_image,
+  //   free_buffer             port, buffer, error
+  //   empty_/fill_this_buffer buffer, filled length, error
+  //   setup_tunnel            port, tunneled port, error
+  // Callbacks:
+  //   event                   event, data1, data2
+  //   empty_buffer_done       buffer, 0, 0
+  //   fill_buffer_done        buffer, filled length, flags
+  boost::uint32_t a, b, c;
+  boost::uint8_t kind;
+  // Components are numbered in the order their handles were got
+  boost::uint8_t component;
+  boost::uint16_t payload;
+
+  static boost::uint32_t const no_cause = 0xFFFFFFFFu;
+
+  bool is_call() const { return kind < event; }
+};
+
+namespace detail {
+
+inline boost::uint64_t monotonic_microseconds()
+{
+  timespec t;
+  ::clock_gettime(CLOCK_MONOTONIC, &t);
+  return boost::uint64_t(t.tv_sec) * 1000000u + t.tv_nsec / 1000u;
+}
+
+// The OMX core functions, which a build for replaying on a machine
+// without the OMX libraries defines GHTV_OMX_RPI_REPLAY_ONLY to do
+// without
+namespace omx_core {
+
+inline OMX_ERRORTYPE init()
+{
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+  return ::OMX_Init();
+#else
+  return OMX_ErrorNotImplemented;
+#endif
+}
+
+inline OMX_ERRORTYPE get_handle(OMX_HANDLETYPE* handle, char const* name
+                                , OMX_PTR app_data, OMX_CALLBACKTYPE* callbacks)
+{
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+  return OMX_GetHandle (handle, const_cast<char*>(name), app_data, callbacks);
+#else
+  return OMX_ErrorNotImplemented;
+#endif
+}
+
+inline OMX_ERRORTYPE free_handle(OMX_HANDLETYPE handle)
+{
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+  return OMX_FreeHandle (handle);
+#else
+  return OMX_ErrorNotImplemented;
+#endif
+}
+
+inline OMX_ERRORTYPE setup_tunnel(OMX_HANDLETYPE out, int out_port, OMX_HANDLETYPE in, int in_port)
+{
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+  return OMX_SetupTunnel (out, out_port, in, in_port);
+#else
+  return OMX_ErrorNotImplemented;
+#endif
+}
+
+}
+
+}
+
+// Records every OMX call and callback of the components whose handles
+// are got through it to a log, or replays such a log in place of the
+// components, with the original latencies, so the pipeline runs off
+// the device against the timing of a real one.
+//
+// The handles it gives are its own components, forwarding to the real
+// ones when recording. A replayed call returns what the recorded call
+// of the same kind on the same component returned, in order, after
+// taking as long; the callbacks that answered it follow it after the
+// same delays. Calls of one component are matched by kind, and by
+// index for parameters and configs, so changes in how the application
+// interleaves calls replay as long as each component sees the same
+// sequence. Buffer contents are not recorded, a replayed filled buffer
+// has only its length and flags.
+struct omx_trace : boost::noncopyable
+{
+  enum trace_mode { record, replay };
+
+  omx_trace(std::string const& path, trace_mode mode)
+    : path(path), mode(mode), start(detail::monotonic_microseconds()), stopping(false)
+    , delivering(0)
+  {
+    if(mode == replay)
+    {
+      read_log();
+      scheduler = boost::thread(boost::bind(&omx_trace::deliver_callbacks, this));
+    }
+#ifdef GHTV_OMX_RPI_REPLAY_ONLY
+    else
+      throw std::runtime_error("Couldn't record, built for replaying only");
+#endif
+  }
+
+  // Writes the log when recording. The components must be freed
+  // before
+  ~omx_trace()
+  {
+    if(mode == replay)
+    {
+      {
+        boost::unique_lock<boost::mutex> l(mutex);
+        stopping = true;
+        condition.notify_one();
+      }
+      scheduler.join();
+    }
+    else
+      write_log();
+  }
+
+  OMX_ERRORTYPE init()
+  {
+    return mode == record ? detail::omx_core::init() : OMX_ErrorNone;
+  }
+
+  OMX_ERRORTYPE get_handle(OMX_HANDLETYPE* handle, char const* name
+                           , OMX_PTR app_data, OMX_CALLBACKTYPE* callbacks)
+  {
+    boost::shared_ptr<component> c(new component(this, app_data, *callbacks));
+    if(mode == record)
+    {
+      OMX_CALLBACKTYPE traced = {&omx_trace::event_handler, &omx_trace::empty_buffer_done
+                                 , &omx_trace::fill_buffer_done};
+      OMX_ERRORTYPE r = detail::omx_core::get_handle(&c->real, name, c.get(), &traced);
+      if(r != OMX_ErrorNone)
+        return r;
+    }
+    boost::unique_lock<boost::mutex> l(mutex);
+    c->id = components.size();
+    components.push_back(c);
+    *handle = &c->handle;
+    return OMX_ErrorNone;
+  }
+
+  OMX_ERRORTYPE free_handle(OMX_HANDLETYPE handle)
+  {
+    component& c = self(handle);
+    OMX_ERRORTYPE r = mode == record ? detail::omx_core::free_handle(c.real) : OMX_ErrorNone;
+    boost::unique_lock<boost::mutex> l(mutex);
+    // Callbacks still scheduled for it are dropped
+    c.freed = true;
+    return r;
+  }
+
+  // in is null to tear the tunnel down
+  OMX_ERRORTYPE setup_tunnel(OMX_HANDLETYPE out, int out_port, OMX_HANDLETYPE in, int in_port)
+  {
+    component& c = self(out);
+    if(mode == replay)
+      return replay_call(c, omx_trace_record::setup_tunnel, 0u);
+    call_record call(c, omx_trace_record::setup_tunnel, out_port, in_port);
+    return call.returned(detail::omx_core::setup_tunnel(c.real, out_port, in ? self(in).real : 0, in_port));
+  }
+
+private:
+  struct component
+  {
+    OMX_COMPONENTTYPE handle;
+    omx_trace* trace;
+    OMX_HANDLETYPE real;
+    std::size_t id;
+    OMX_PTR app_data;
+    OMX_CALLBACKTYPE callbacks;
+    bool freed;
+    // Indexed by buffer number
+    std::vector<OMX_BUFFERHEADERTYPE*> buffers;
+
+    // Recording: the calls callbacks answer
+    std::map<std::pair<boost::uint32_t, boost::uint32_t>, boost::uint32_t> sent_commands;
+    std::map<boost::uint32_t, boost::uint32_t> buffer_calls;
+    boost::uint32_t last_call;
+
+    component(omx_trace* trace, OMX_PTR app_data, OMX_CALLBACKTYPE callbacks)
+      : trace(trace), real(0), id(0u), app_data(app_data), callbacks(callbacks), freed(false)
+      , last_call(omx_trace_record::no_cause)
+    {
+      std::memset(&handle, 0, sizeof handle);
+      handle.nSize = sizeof handle;
+      handle.nVersion.nVersion = OMX_VERSION;
+      handle.pComponentPrivate = this;
+      handle.SendCommand = &omx_trace::send_command;
+      handle.GetParameter = &omx_trace::get_parameter;
+      handle.SetParameter = &omx_trace::set_parameter;
+      handle.GetConfig = &omx_trace::get_config;
+      handle.SetConfig = &omx_trace::set_config;
+      handle.GetState = &omx_trace::get_state;
+      handle.UseBuffer = &omx_trace::use_buffer;
+      handle.AllocateBuffer = &omx_trace::allocate_buffer;
+      handle.FreeBuffer = &omx_trace::free_buffer;
+      handle.EmptyThisBuffer = &omx_trace::empty_this_buffer;
+      handle.FillThisBuffer = &omx_trace::fill_this_buffer;
+      handle.UseEGLImage = &omx_trace::use_egl_image;
+    }
+
+    // Buffer number, the buffer must have been created through the trace
+    boost::uint32_t number(OMX_BUFFERHEADERTYPE* header) const
+    {
+      return std::find(buffers.begin(), buffers.end(), header) - buffers.begin();
+    }
+
+    void numbered(boost::uint32_t number, OMX_BUFFERHEADERTYPE* header)
+    {
+      if(buffers.size() <= number)
+        buffers.resize(number + 1u);
+      buffers[number] = header;
+    }
+
+    // The number a new buffer gets, a freed one's if any
+    boost::uint32_t free_number() const
+    {
+      return number(0);
+    }
+  };
+
+  static component& self(OMX_HANDLETYPE handle)
+  {
+    return *static_cast<component*>(static_cast<OMX_COMPONENTTYPE*>(handle)->pComponentPrivate);
+  }
+
+  // A call being recorded. Its record is added before the call is
+  // made, so the callbacks that answer it, which may come before it
+  // returns, find it
+  struct call_record
+  {
+    component& c;
+    boost::uint32_t index;
+    boost::uint64_t started;
+
+    call_record(component& c, omx_trace_record::record_kind kind, boost::uint32_t a, boost::uint32_t b)
+      : c(c)
+    {
+      omx_trace& t = *c.trace;
+      boost::unique_lock<boost::mutex> l(t.mutex);
+      index = t.add_record(kind, c.id, a, b, 0u);
+      c.last_call = index;
+      if(kind == omx_trace_record::send_command)
+        c.sent_commands[std::make_pair(a, b)] = index;
+      else if(kind == omx_trace_record::empty_this_buffer || kind == omx_trace_record::fill_this_buffer)
+        c.buffer_calls[a] = index;
+      started = detail::monotonic_microseconds();
+    }
+
+    OMX_ERRORTYPE returned(OMX_ERRORTYPE r, void const* payload = 0, std::size_t size = 0u)
+    {
+      omx_trace& t = *c.trace;
+      boost::uint64_t now = detail::monotonic_microseconds();
+      boost::unique_lock<boost::mutex> l(t.mutex);
+      omx_trace_record& record = t.records[index];
+      record.duration = now - started;
+      record.c = r;
+      if(r == OMX_ErrorNone && payload)
+        t.add_payload(index, payload, size);
+      return r;
+    }
+  };
+
+  // Already locked
+  boost::uint32_t add_record(omx_trace_record::record_kind kind, std::size_t component
+                             , boost::uint32_t a, boost::uint32_t b, boost::uint32_t c
+                             , boost::uint32_t cause = omx_trace_record::no_cause)
+  {
+    omx_trace_record record;
+    std::memset(&record, 0, sizeof record);
+    record.time = detail::monotonic_microseconds() - start;
+    record.cause = cause;
+    record.a = a;
+    record.b = b;
+    record.c = c;
+    record.kind = kind;
+    record.component = component;
+    records.push_back(record);
+    payload_offsets.push_back(payloads.size());
+    return records.size() - 1u;
+  }
+
+  // Already locked
+  void add_payload(boost::uint32_t index, void const* payload, std::size_t size)
+  {
+    size = std::min<std::size_t>(size, 0xFFFFu);
+    payload_offsets[index] = payloads.size();
+    records[index].payload = size;
+    unsigned char const* bytes = static_cast<unsigned char const*>(payload);
+    payloads.insert(payloads.end(), bytes, bytes + size);
+  }
+
+  static std::size_t structure_size(OMX_PTR structure)
+  {
+    return *static_cast<OMX_U32 const*>(structure);
+  }
+
+  // Calls, each recorded or replayed
+
+  static OMX_ERRORTYPE send_command(OMX_HANDLETYPE handle, OMX_COMMANDTYPE command
+                                    , OMX_U32 param, OMX_PTR data)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::send_command, 0u);
+    call_record call(c, omx_trace_record::send_command, command, param);
+    return call.returned(OMX_SendCommand (c.real, command, param, data));
+  }
+
+  static OMX_ERRORTYPE get_parameter(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR structure)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::get_parameter, index, structure);
+    call_record call(c, omx_trace_record::get_parameter, index, 0u);
+    return call.returned(OMX_GetParameter (c.real, index, structure)
+                         , structure, structure_size(structure));
+  }
+
+  static OMX_ERRORTYPE set_parameter(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR structure)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::set_parameter, index);
+    call_record call(c, omx_trace_record::set_parameter, index, 0u);
+    return call.returned(OMX_SetParameter (c.real, index, structure));
+  }
+
+  static OMX_ERRORTYPE get_config(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR structure)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::get_config, index, structure);
+    call_record call(c, omx_trace_record::get_config, index, 0u);
+    return call.returned(OMX_GetConfig (c.real, index, structure)
+                         , structure, structure_size(structure));
+  }
+
+  static OMX_ERRORTYPE set_config(OMX_HANDLETYPE handle, OMX_INDEXTYPE index, OMX_PTR structure)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::set_config, index);
+    call_record call(c, omx_trace_record::set_config, index, 0u);
+    return call.returned(OMX_SetConfig (c.real, index, structure));
+  }
+
+  static OMX_ERRORTYPE get_state(OMX_HANDLETYPE handle, OMX_STATETYPE* state)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+    {
+      omx_trace_record record;
+      record.a = OMX_StateInvalid;
+      OMX_ERRORTYPE r = c.trace->replay_call(c, omx_trace_record::get_state, 0u, 0, &record);
+      *state = static_cast<OMX_STATETYPE>(record.a);
+      return r;
+    }
+    call_record call(c, omx_trace_record::get_state, 0u, 0u);
+    OMX_ERRORTYPE r = OMX_GetState (c.real, state);
+    c.trace->records_a(call.index, *state);
+    return call.returned(r);
+  }
+
+  static OMX_ERRORTYPE use_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE** header
+                                  , OMX_U32 port, OMX_PTR app_private, OMX_U32 size, OMX_U8* buffer)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_buffer(c, omx_trace_record::use_buffer, header, port, app_private
+                                    , size, buffer);
+    boost::uint32_t number = c.free_number();
+    call_record call(c, omx_trace_record::use_buffer, port, number);
+    OMX_ERRORTYPE r = OMX_UseBuffer (c.real, header, port, app_private, size, buffer);
+    return call.returned(c.trace->created(c, r, *header, number));
+  }
+
+  static OMX_ERRORTYPE allocate_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE** header
+                                       , OMX_U32 port, OMX_PTR app_private, OMX_U32 size)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_buffer(c, omx_trace_record::allocate_buffer, header, port, app_private
+                                    , size, 0);
+    boost::uint32_t number = c.free_number();
+    call_record call(c, omx_trace_record::allocate_buffer, port, number);
+    OMX_ERRORTYPE r = OMX_AllocateBuffer (c.real, header, port, app_private, size);
+    return call.returned(c.trace->created(c, r, *header, number));
+  }
+
+  static OMX_ERRORTYPE use_egl_image(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE** header
+                                     , OMX_U32 port, OMX_PTR app_private, void* image)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_buffer(c, omx_trace_record::use_egl_image, header, port, app_private
+                                    , 0u, 0);
+    boost::uint32_t number = c.free_number();
+    call_record call(c, omx_trace_record::use_egl_image, port, number);
+    OMX_ERRORTYPE r = OMX_UseEGLImage (c.real, header, port, app_private, image);
+    return call.returned(c.trace->created(c, r, *header, number));
+  }
+
+  static OMX_ERRORTYPE free_buffer(OMX_HANDLETYPE handle, OMX_U32 port, OMX_BUFFERHEADERTYPE* header)
+  {
+    component& c = self(handle);
+    boost::uint32_t number = c.number(header);
+    if(c.trace->mode == replay)
+    {
+      OMX_ERRORTYPE r = c.trace->replay_call(c, omx_trace_record::free_buffer, 0u);
+      c.trace->forget_buffer(c, number, header);
+      if(header->pPlatformPrivate)
+        delete[] header->pBuffer;
+      delete header;
+      return r;
+    }
+    call_record call(c, omx_trace_record::free_buffer, port, number);
+    OMX_ERRORTYPE r = call.returned(OMX_FreeBuffer (c.real, port, header));
+    c.trace->forget_buffer(c, number, header);
+    return r;
+  }
+
+  // Drops the buffer from the callbacks still to come, then waits for
+  // one being delivered with it to return, unless it's that callback
+  // freeing it
+  void forget_buffer(component& c, boost::uint32_t number, OMX_BUFFERHEADERTYPE* header)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    if(number != c.buffers.size())
+      c.buffers[number] = 0;
+    if(boost::this_thread::get_id() != scheduler.get_id())
+      while(delivering == header)
+        delivered.wait(l);
+  }
+
+  static OMX_ERRORTYPE empty_this_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE* header)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::empty_this_buffer, 0u);
+    call_record call(c, omx_trace_record::empty_this_buffer, c.number(header), header->nFilledLen);
+    return call.returned(OMX_EmptyThisBuffer (c.real, header));
+  }
+
+  static OMX_ERRORTYPE fill_this_buffer(OMX_HANDLETYPE handle, OMX_BUFFERHEADERTYPE* header)
+  {
+    component& c = self(handle);
+    if(c.trace->mode == replay)
+      return c.trace->replay_call(c, omx_trace_record::fill_this_buffer, 0u);
+    call_record call(c, omx_trace_record::fill_this_buffer, c.number(header), 0u);
+    return call.returned(OMX_FillThisBuffer (c.real, header));
+  }
+
+  void records_a(boost::uint32_t index, boost::uint32_t a)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    records[index].a = a;
+  }
+
+  OMX_ERRORTYPE created(component& c, OMX_ERRORTYPE r, OMX_BUFFERHEADERTYPE* header
+                        , boost::uint32_t number)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    if(r == OMX_ErrorNone)
+      c.numbered(number, header);
+    return r;
+  }
+
+  // Callbacks, recorded and passed on with the traced handle
+
+  static OMX_ERRORTYPE event_handler(OMX_HANDLETYPE, OMX_PTR app_data, OMX_EVENTTYPE event
+                                     , OMX_U32 data1, OMX_U32 data2, OMX_PTR event_data)
+  {
+    component& c = *static_cast<component*>(app_data);
+    {
+      omx_trace& t = *c.trace;
+      boost::unique_lock<boost::mutex> l(t.mutex);
+      boost::uint32_t cause = c.last_call;
+      if(event == OMX_EventCmdComplete)
+      {
+        std::map<std::pair<boost::uint32_t, boost::uint32_t>, boost::uint32_t>::const_iterator
+          sent = c.sent_commands.find(std::make_pair(data1, data2));
+        if(sent != c.sent_commands.end())
+          cause = sent->second;
+      }
+      t.add_record(omx_trace_record::event, c.id, event, data1, data2, cause);
+    }
+    return c.callbacks.EventHandler(&c.handle, c.app_data, event, data1, data2, event_data);
+  }
+
+  static OMX_ERRORTYPE empty_buffer_done(OMX_HANDLETYPE, OMX_PTR app_data, OMX_BUFFERHEADERTYPE* header)
+  {
+    component& c = *static_cast<component*>(app_data);
+    c.trace->record_buffer_done(c, omx_trace_record::empty_buffer_done, header);
+    return c.callbacks.EmptyBufferDone(&c.handle, c.app_data, header);
+  }
+
+  static OMX_ERRORTYPE fill_buffer_done(OMX_HANDLETYPE, OMX_PTR app_data, OMX_BUFFERHEADERTYPE* header)
+  {
+    component& c = *static_cast<component*>(app_data);
+    c.trace->record_buffer_done(c, omx_trace_record::fill_buffer_done, header);
+    return c.callbacks.FillBufferDone(&c.handle, c.app_data, header);
+  }
+
+  void record_buffer_done(component& c, omx_trace_record::record_kind kind, OMX_BUFFERHEADERTYPE* header)
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    boost::uint32_t number = c.number(header), cause = omx_trace_record::no_cause;
+    std::map<boost::uint32_t, boost::uint32_t>::const_iterator call = c.buffer_calls.find(number);
+    if(call != c.buffer_calls.end())
+      cause = call->second;
+    if(kind == omx_trace_record::fill_buffer_done)
+      add_record(kind, c.id, number, header->nFilledLen, header->nFlags, cause);
+    else
+      add_record(kind, c.id, number, 0u, 0u, cause);
+  }
+
+  void write_log()
+  {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if(!file)
+      return;
+    for(std::size_t i = 0; i != records.size(); ++i)
+    {
+      std::fwrite(&records[i], sizeof (omx_trace_record), 1u, file);
+      if(records[i].payload)
+        std::fwrite(&payloads[payload_offsets[i]], records[i].payload, 1u, file);
+    }
+    std::fclose(file);
+  }
+
+  // Replaying
+
+  void read_log()
+  {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if(!file)
+      throw std::runtime_error("Couldn't open the OMX trace " + path);
+    omx_trace_record record;
+    while(std::fread(&record, sizeof record, 1u, file) == 1u)
+    {
+      payload_offsets.push_back(payloads.size());
+      payloads.resize(payloads.size() + record.payload);
+      if(record.payload
+         && std::fread(&payloads[payload_offsets.back()], record.payload, 1u, file) != 1u)
+        break;
+      records.push_back(record);
+    }
+    std::fclose(file);
+
+    answers.resize(records.size());
+    for(std::size_t i = 0; i != records.size(); ++i)
+    {
+      if(records[i].is_call())
+        calls[call_key(records[i].component, records[i].kind, call_index(records[i]))].push_back(i);
+      else if(records[i].cause < records.size())
+        answers[records[i].cause].push_back(i);
+      else
+        // Nothing to wait for, it comes when it came
+        schedule(start + records[i].time, i);
+    }
+  }
+
+  typedef std::pair<std::pair<std::size_t, boost::uint32_t>, boost::uint32_t> call_key_type;
+
+  static call_key_type call_key(std::size_t component, boost::uint32_t kind, boost::uint32_t index)
+  {
+    return std::make_pair(std::make_pair(component, kind), index);
+  }
+
+  static boost::uint32_t call_index(omx_trace_record const& record)
+  {
+    switch(record.kind)
+    {
+    case omx_trace_record::get_parameter:
+    case omx_trace_record::set_parameter:
+    case omx_trace_record::get_config:
+    case omx_trace_record::set_config:
+      return record.a;
+    default:
+      return 0u;
+    }
+  }
+
+  // Takes the next recorded call of its kind, as long as it did, and
+  // schedules the callbacks that answered it. The log ran out if
+  // there is none
+  OMX_ERRORTYPE replay_call(component& c, omx_trace_record::record_kind kind, boost::uint32_t index
+                            , OMX_PTR structure = 0, omx_trace_record* result = 0)
+  {
+    boost::uint32_t duration;
+    OMX_ERRORTYPE r;
+    {
+      boost::unique_lock<boost::mutex> l(mutex);
+      std::map<call_key_type, std::deque<std::size_t> >::iterator
+        call = calls.find(call_key(c.id, kind, index));
+      if(call == calls.end() || call->second.empty())
+        return OMX_ErrorUndefined;
+      std::size_t i = call->second.front();
+      call->second.pop_front();
+
+      omx_trace_record const& record = records[i];
+      duration = record.duration;
+      r = static_cast<OMX_ERRORTYPE>(record.c);
+      if(result)
+        *result = record;
+      if(structure && record.payload)
+        std::memcpy(structure, &payloads[payload_offsets[i]]
+                    , std::min<std::size_t>(record.payload, structure_size(structure)));
+
+      boost::uint64_t now = detail::monotonic_microseconds();
+      for(std::vector<std::size_t>::const_iterator first = answers[i].begin()
+            , last = answers[i].end(); first != last; ++first)
+        schedule(now + (records[*first].time - record.time), *first);
+    }
+    if(duration)
+      boost::this_thread::sleep(boost::posix_time::microseconds(duration));
+    return r;
+  }
+
+  // Buffers are the trace's own, numbered as they were recorded
+  OMX_ERRORTYPE replay_buffer(component& c, omx_trace_record::record_kind kind
+                              , OMX_BUFFERHEADERTYPE** header, OMX_U32 port, OMX_PTR app_private
+                              , OMX_U32 size, OMX_U8* buffer)
+  {
+    omx_trace_record record;
+    OMX_ERRORTYPE r = replay_call(c, kind, 0u, 0, &record);
+    if(r != OMX_ErrorNone)
+      return r;
+
+    OMX_BUFFERHEADERTYPE* h = new OMX_BUFFERHEADERTYPE;
+    std::memset(h, 0, sizeof *h);
+    h->nSize = sizeof *h;
+    h->nVersion.nVersion = OMX_VERSION;
+    h->pAppPrivate = app_private;
+    h->nAllocLen = size;
+    h->pBuffer = buffer;
+    if(kind == omx_trace_record::allocate_buffer)
+    {
+      h->pBuffer = new OMX_U8[size]();
+      // Owned
+      h->pPlatformPrivate = h;
+    }
+    if(kind == omx_trace_record::use_egl_image)
+      h->nOutputPortIndex = port;
+    else
+      h->nInputPortIndex = h->nOutputPortIndex = port;
+
+    boost::unique_lock<boost::mutex> l(mutex);
+    c.numbered(record.b, h);
+    *header = h;
+    return r;
+  }
+
+  // Already locked
+  void schedule(boost::uint64_t due, std::size_t record)
+  {
+    due_callbacks.push(std::make_pair(due, record));
+    condition.notify_one();
+  }
+
+  // The replaying callback thread
+  void deliver_callbacks()
+  {
+    boost::unique_lock<boost::mutex> l(mutex);
+    while(!stopping)
+    {
+      if(due_callbacks.empty())
+      {
+        condition.wait(l);
+        continue;
+      }
+      boost::uint64_t due = due_callbacks.top().first, now = detail::monotonic_microseconds();
+      if(due > now)
+      {
+        condition.timed_wait(l, boost::posix_time::microseconds(due - now));
+        continue;
+      }
+      omx_trace_record const& record = records[due_callbacks.top().second];
+      due_callbacks.pop();
+      if(record.component >= components.size() || components[record.component]->freed)
+        continue;
+      component& c = *components[record.component];
+      OMX_BUFFERHEADERTYPE* header = 0;
+      if(record.kind != omx_trace_record::event)
+      {
+        if(record.a >= c.buffers.size() || !(header = c.buffers[record.a]))
+          continue;
+        if(record.kind == omx_trace_record::fill_buffer_done)
+        {
+          header->nOffset = 0u;
+          header->nFilledLen = std::min<OMX_U32>(record.b, header->nAllocLen);
+          header->nFlags = record.c;
+        }
+      }
+
+      delivering = header;
+      l.unlock();
+      if(record.kind == omx_trace_record::event)
+        c.callbacks.EventHandler(&c.handle, c.app_data, static_cast<OMX_EVENTTYPE>(record.a)
+                                 , record.b, record.c, 0);
+      else if(record.kind == omx_trace_record::empty_buffer_done)
+        c.callbacks.EmptyBufferDone(&c.handle, c.app_data, header);
+      else
+        c.callbacks.FillBufferDone(&c.handle, c.app_data, header);
+      l.lock();
+      delivering = 0;
+      delivered.notify_all();
+    }
+  }
+
+  std::string path;
+  trace_mode mode;
+  boost::uint64_t start;
+  boost::mutex mutex;
+  boost::condition_variable condition;
+  std::vector<boost::shared_ptr<component> > components;
+  std::vector<omx_trace_record> records;
+  std::vector<std::size_t> payload_offsets;
+  std::vector<unsigned char> payloads;
+
+  // Replaying
+  std::vector<std::vector<std::size_t> > answers;
+  std::map<call_key_type, std::deque<std::size_t> > calls;
+  typedef std::pair<boost::uint64_t, std::size_t> due_callback;
+  std::priority_queue<due_callback, std::vector<due_callback>, std::greater<due_callback> > due_callbacks;
+  bool stopping;
+  // The buffer of the callback being delivered, freeing it waits
+  OMX_BUFFERHEADERTYPE* delivering;
+  boost::condition_variable delivered;
+  boost::thread scheduler;
+};
+
+} }
+
+#endif
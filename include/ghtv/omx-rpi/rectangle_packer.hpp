@@ -0,0 +1,138 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_RECTANGLE_PACKER_HPP
+#define GHTV_OMX_RPI_RECTANGLE_PACKER_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+// Skyline bottom-left packer: keeps the top edge of the packed area as
+// a list of horizontal segments and places each rectangle where it
+// ends lowest.
+struct rectangle_packer
+{
+  rectangle_packer(unsigned int width, unsigned int height)
+    : width(width), height(height), used_area(0u)
+  {
+    segment s = {0u, 0u, width};
+    skyline.push_back(s);
+  }
+
+  bool insert(unsigned int w, unsigned int h, unsigned int& x, unsigned int& y)
+  {
+    if(!w || !h || w > width || h > height)
+      return false;
+
+    std::size_t best = skyline.size();
+    unsigned int best_y = height, best_x = width;
+    for(std::size_t i = 0; i != skyline.size(); ++i)
+    {
+      unsigned int top;
+      if(fits(i, w, h, top) && (top < best_y || (top == best_y && skyline[i].x < best_x)))
+      {
+        best = i;
+        best_y = top;
+        best_x = skyline[i].x;
+      }
+    }
+    if(best == skyline.size())
+      return false;
+
+    x = best_x;
+    y = best_y;
+    segment s = {x, y + h, w};
+    skyline.insert(skyline.begin() + best, s);
+
+    // Shrink or remove the segments now below the new one
+    for(std::size_t i = best + 1; i != skyline.size();)
+    {
+      unsigned int end = x + w;
+      if(skyline[i].x >= end)
+        break;
+      unsigned int shrink = end - skyline[i].x;
+      if(shrink < skyline[i].width)
+      {
+        skyline[i].x += shrink;
+        skyline[i].width -= shrink;
+        break;
+      }
+      skyline.erase(skyline.begin() + i);
+    }
+
+    for(std::size_t i = 0; i + 1 < skyline.size();)
+    {
+      if(skyline[i].y == skyline[i + 1].y)
+      {
+        skyline[i].width += skyline[i + 1].width;
+        skyline.erase(skyline.begin() + i + 1);
+      }
+      else
+        ++i;
+    }
+
+    used_area += w * h;
+    return true;
+  }
+
+  void clear()
+  {
+    skyline.clear();
+    segment s = {0u, 0u, width};
+    skyline.push_back(s);
+    used_area = 0u;
+  }
+
+  // Fraction of the area covered by rectangles
+  float occupancy() const
+  {
+    return float(used_area) / (float(width) * height);
+  }
+
+  unsigned int width, height;
+private:
+  struct segment
+  {
+    unsigned int x, y, width;
+  };
+
+  bool fits(std::size_t index, unsigned int w, unsigned int h, unsigned int& top) const
+  {
+    if(skyline[index].x + w > width)
+      return false;
+    top = 0u;
+    for(unsigned int left = w; left;)
+    {
+      assert(index < skyline.size()); // The skyline spans the whole width
+      top = (std::max)(top, skyline[index].y);
+      if(top + h > height)
+        return false;
+      left -= (std::min)(left, skyline[index].width);
+      ++index;
+    }
+    return true;
+  }
+
+  std::vector<segment> skyline;
+  unsigned long used_area;
+};
+
+} }
+
+#endif
@@ -0,0 +1,525 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_SHARED_IMAGE_CACHE_HPP
+#define GHTV_OMX_RPI_SHARED_IMAGE_CACHE_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/cstdint.hpp>
+
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+namespace ghtv { namespace omx_rpi {
+
+namespace detail {
+
+boost::uint32_t const shared_image_cache_magic = 0x47485346u; // GHSF
+
+// allocation packs the generation of the data area in its top bits,
+// the writers copying into it in the middle ones and the bytes used
+// below, so they change in one compare-and-swap. Starting the data
+// area over bumps the generation, which makes every entry of the
+// previous one stale; it waits for the writers to be done, so none
+// copies into space the new generation handed out again.
+unsigned int const shared_image_cache_used_bits = 36u;
+unsigned int const shared_image_cache_generation_shift = 44u;
+boost::uint64_t const shared_image_cache_used_mask
+  = (boost::uint64_t(1u) << shared_image_cache_used_bits) - 1u;
+boost::uint64_t const shared_image_cache_copier
+  = boost::uint64_t(1u) << shared_image_cache_used_bits;
+boost::uint64_t const shared_image_cache_copiers_mask
+  = (boost::uint64_t(1u) << shared_image_cache_generation_shift)
+  - shared_image_cache_copier;
+
+struct shared_image_cache_header
+{
+  boost::uint32_t magic;
+  boost::uint32_t slot_count;
+  boost::uint64_t data_size;
+  boost::uint64_t allocation;
+  boost::uint32_t initialized;
+  boost::uint32_t reserved;
+};
+
+// writer is the pid of the process publishing the slot, 0 if none;
+// one that died holding it is replaced by the next publisher. sequence
+// is a seqlock: odd while the slot is being written. generation is
+// the data area's generation plus one, 0 while the slot has no data.
+// key is claimed with a compare-and-swap while the slot is free. Once
+// none is, a publisher swaps the key of a slot whose entry went stale,
+// holding its writer lock and with sequence odd; slots are never
+// freed, so probing still reaches every key.
+struct shared_image_cache_slot
+{
+  boost::uint64_t key;
+  boost::uint32_t writer;
+  boost::uint32_t sequence;
+  boost::uint32_t generation;
+  boost::uint32_t width;
+  boost::uint32_t height;
+  boost::uint32_t stride;
+  boost::uint32_t format;
+  boost::uint32_t type;
+  boost::uint64_t source_size;
+  boost::int64_t source_mtime;
+  boost::uint64_t source_hash;
+  boost::uint64_t source_inode;
+  boost::uint64_t offset;
+  boost::uint64_t size;
+  // Of the space at offset, reused when republishing fits in it
+  boost::uint64_t capacity;
+};
+
+}
+
+// Pixels in a shared_image_cache, mapped as long as the cache object
+// that returned them. Republishing the entry or starting the data area
+// over may overwrite them, intact tells whether that happened since
+// find returned them.
+struct shared_image
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+  GLenum format;
+  GLenum type;
+  unsigned char const* pixels;
+  std::size_t size;
+
+  volatile boost::uint32_t const* slot_sequence;
+  boost::uint32_t sequence;
+  volatile boost::uint64_t const* allocation;
+  boost::uint64_t generation;
+
+  bool intact() const
+  {
+    __sync_synchronize();
+    return *slot_sequence == sequence
+      && *allocation >> detail::shared_image_cache_generation_shift == generation;
+  }
+
+  // Must be called with a current EGL context
+  void upload(GLuint texture_id) const
+  {
+    upload_texture(texture_id, width, height, stride, format, type, pixels, size);
+  }
+
+  void copy_to(decoded_image& image) const
+  {
+    image.width = width;
+    image.height = height;
+    image.stride = stride;
+    image.format = format;
+    image.type = type;
+    image.pixels.assign(pixels, pixels + size);
+  }
+};
+
+// Decoded pixels in a named POSIX shared memory object, so processes
+// loading the same artwork decode it once. The index is an open
+// addressing table updated with atomic operations only. Pixel data is
+// appended; an entry republished with no more bytes than it had reuses
+// its space. When the data area is full it starts over empty, in a new
+// generation that makes the entries of the previous one stale, and
+// whose slots are then reclaimed for new sources once the index is
+// full. An entry larger than the whole data area is never published.
+struct shared_image_cache : boost::noncopyable
+{
+  enum open_mode { read_write, read_only };
+
+  shared_image_cache(std::string const& name, open_mode mode = read_write
+                     , std::size_t data_size = 64u*1024u*1024u, unsigned int slot_count = 1024u)
+    : base(0), length(0), writable(mode == read_write)
+  {
+    bool created = false;
+    int fd = -1;
+    if(writable)
+    {
+      fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      created = fd >= 0;
+      if(created
+         && ::ftruncate(fd, sizeof(detail::shared_image_cache_header)
+                        + slot_count*sizeof(detail::shared_image_cache_slot) + data_size) != 0)
+      {
+        ::close(fd);
+        ::shm_unlink(name.c_str());
+        throw std::runtime_error("Couldn't size shared image cache");
+      }
+    }
+    if(fd < 0)
+      fd = ::shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    if(fd < 0)
+      throw std::runtime_error("Couldn't open shared image cache " + name);
+
+    struct stat st;
+    // The creator may not have sized it yet
+    for(int i = 0; ::fstat(fd, &st) == 0 && !st.st_size && i != 100; ++i)
+      ::usleep(1000);
+    length = st.st_size;
+    if(length >= sizeof(detail::shared_image_cache_header))
+      base = ::mmap(0, length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(!base || base == MAP_FAILED)
+      throw std::runtime_error("Couldn't map shared image cache " + name);
+
+    if(created)
+    {
+      header()->magic = detail::shared_image_cache_magic;
+      header()->slot_count = slot_count;
+      header()->data_size = data_size;
+      header()->allocation = 0u;
+      __sync_synchronize();
+      header()->initialized = 1u;
+    }
+    else
+      for(int i = 0; !*static_cast<volatile boost::uint32_t*>(&header()->initialized) && i != 100; ++i)
+        ::usleep(1000);
+
+    __sync_synchronize();
+    if(!header()->initialized || header()->magic != detail::shared_image_cache_magic)
+    {
+      ::munmap(base, length);
+      throw std::runtime_error("Invalid shared image cache " + name);
+    }
+  }
+
+  ~shared_image_cache()
+  {
+    ::munmap(base, length);
+  }
+
+  static void remove(std::string const& name)
+  {
+    ::shm_unlink(name.c_str());
+  }
+
+  bool find(std::string const& source, shared_image& image) const
+  {
+    source_stamp stamp;
+    return make_source_stamp(source, stamp) && find(source, stamp, image);
+  }
+
+  bool find(std::string const& source, source_stamp& stamp, shared_image& image) const
+  {
+    return find(source, stamp, source, image);
+  }
+
+  // name is the entry's, a variant of source or source itself. stamp
+  // gets the source's hash if it had to be checked
+  bool find(std::string const& name, source_stamp& stamp, std::string const& source
+            , shared_image& image) const
+  {
+    boost::uint64_t k = key(name);
+    detail::shared_image_cache_slot* slot = lookup(k, false);
+    if(!slot)
+      return false;
+
+    boost::uint32_t sequence = load(slot->sequence);
+    boost::uint64_t generation = current_generation();
+    __sync_synchronize();
+    // The key may have been swapped since lookup found it
+    if(sequence & 1u || load(slot->key) != k || load(slot->generation) != generation + 1u)
+      return false;
+    image.width = slot->width;
+    image.height = slot->height;
+    image.stride = slot->stride;
+    image.format = slot->format;
+    image.type = slot->type;
+    image.pixels = data() + slot->offset;
+    image.size = slot->size;
+    image.slot_sequence = &slot->sequence;
+    image.sequence = sequence;
+    image.allocation = &header()->allocation;
+    image.generation = generation;
+    source_stamp stored = {slot->source_size, slot->source_mtime, slot->source_inode
+                           , slot->source_hash, true};
+    __sync_synchronize();
+    return load(slot->sequence) == sequence && same_source(stored, stamp, source);
+  }
+
+  bool publish(std::string const& source, decoded_image const& image)
+  {
+    source_stamp stamp;
+    return make_source_stamp(source, stamp, true) && publish(source, stamp, image);
+  }
+
+  // stamp must be hashed
+  bool publish(std::string const& source, source_stamp const& stamp, decoded_image const& image)
+  {
+    assert(stamp.hashed);
+    boost::uint64_t size = image.pixels.size()
+      , rounded = (size + 15u) & ~boost::uint64_t(15u);
+    if(!writable || rounded > header()->data_size)
+      return false;
+    bool reclaimed;
+    detail::shared_image_cache_slot* slot = claim(key(source), reclaimed);
+    if(!slot)
+      return false; // Full, or another process is publishing it
+
+    boost::uint32_t sequence = load(slot->sequence);
+    boost::uint64_t generation = current_generation();
+    // Left odd by a writer that died, the slot's data is torn
+    bool had_data = !reclaimed && !(sequence & 1u) && load(slot->generation) == generation + 1u;
+    slot->sequence = sequence | 1u;
+    __sync_synchronize();
+    if(reclaimed)
+      slot->key = key(source);
+
+    boost::uint64_t offset = slot->offset, capacity = slot->capacity;
+    bool reuse = had_data && capacity >= size;
+    if(!reuse)
+      capacity = rounded;
+    bool copied = begin_copy(slot, reuse, capacity, offset, generation);
+    if(copied)
+    {
+      if(size)
+        std::memcpy(data() + offset, &image.pixels[0], size);
+      end_copy();
+      slot->generation = generation + 1u;
+      slot->width = image.width;
+      slot->height = image.height;
+      slot->stride = image.stride;
+      slot->format = image.format;
+      slot->type = image.type;
+      slot->source_size = stamp.size;
+      slot->source_mtime = stamp.mtime;
+      slot->source_hash = stamp.hash;
+      slot->source_inode = stamp.inode;
+      slot->offset = offset;
+      slot->size = size;
+      slot->capacity = capacity;
+    }
+    else
+      slot->generation = 0u;
+    __sync_synchronize();
+    slot->sequence = (sequence | 1u) + 1u;
+    unlock(slot);
+    return copied;
+  }
+
+private:
+  static boost::uint64_t key(std::string const& source)
+  {
+    return detail::fnv1a(source) | 1u; // 0 marks a free slot
+  }
+
+  static boost::uint32_t load(boost::uint32_t const& v)
+  {
+    return *static_cast<volatile boost::uint32_t const*>(&v);
+  }
+  static boost::uint64_t load(boost::uint64_t const& v)
+  {
+    return *static_cast<volatile boost::uint64_t const*>(&v);
+  }
+
+  // Takes the slot's writer lock, from a process that died holding it
+  // too. Returns false if a live process holds it
+  static bool lock(detail::shared_image_cache_slot* slot)
+  {
+    boost::uint32_t self = ::getpid()
+      , owner = __sync_val_compare_and_swap(&slot->writer, 0u, self);
+    return !owner
+      || (!alive(owner) && __sync_bool_compare_and_swap(&slot->writer, owner, self));
+  }
+
+  static void unlock(detail::shared_image_cache_slot* slot)
+  {
+    __sync_synchronize();
+    slot->writer = 0u;
+  }
+
+  static bool alive(boost::uint32_t pid)
+  {
+    return ::kill(pid, 0) == 0 || errno != ESRCH;
+  }
+
+  boost::uint64_t current_generation() const
+  {
+    return load(header()->allocation) >> detail::shared_image_cache_generation_shift;
+  }
+
+  // The slot of key with its writer lock taken. When the key has none
+  // and no slot is free, one whose entry went stale is reclaimed for
+  // it, and the caller swaps the key; if every entry is fresh the data
+  // area starts over to make them stale. Returns null if it couldn't
+  // or another process is publishing the slot
+  detail::shared_image_cache_slot* claim(boost::uint64_t key, bool& reclaimed)
+  {
+    reclaimed = false;
+    detail::shared_image_cache_slot* slot = lookup(key, true);
+    if(slot)
+    {
+      if(!lock(slot))
+        return 0;
+      // Reclaimed for another key before the lock was taken
+      if(load(slot->key) == key)
+        return slot;
+      unlock(slot);
+      return 0;
+    }
+
+    unsigned int count = header()->slot_count;
+    for(int attempt = 0; attempt != 2; ++attempt)
+    {
+      boost::uint64_t allocation = load(header()->allocation)
+        , fresh = (allocation >> detail::shared_image_cache_generation_shift) + 1u;
+      for(unsigned int i = 0; i != count; ++i)
+      {
+        slot = slots() + (key + i) % count;
+        if(load(slot->generation) == fresh || !lock(slot))
+          continue;
+        if(load(slot->generation) != fresh)
+        {
+          reclaimed = true;
+          return slot;
+        }
+        unlock(slot);
+      }
+      if(!start_over(0, allocation))
+        return 0;
+    }
+    return 0;
+  }
+
+  // Registers as a writer copying into the data area, in the slot's
+  // space when reuse and still in its generation, else in size bytes,
+  // no more than the data area, reserved in the current generation.
+  // When they don't fit in what's left it starts the data area over.
+  // Returns false if it couldn't
+  bool begin_copy(detail::shared_image_cache_slot const* slot, bool reuse, boost::uint64_t size
+                  , boost::uint64_t& offset, boost::uint64_t& generation)
+  {
+    for(;;)
+    {
+      boost::uint64_t allocation = load(header()->allocation)
+        , used = allocation & detail::shared_image_cache_used_mask
+        , copiers = allocation & detail::shared_image_cache_copiers_mask;
+      boost::uint64_t current = allocation >> detail::shared_image_cache_generation_shift;
+      if(copiers == detail::shared_image_cache_copiers_mask)
+        return false;
+      reuse = reuse && current == generation;
+      bool fits = reuse || used + size <= header()->data_size;
+      if(!fits)
+      {
+        if(!start_over(slot, allocation))
+          return false;
+      }
+      else if(__sync_bool_compare_and_swap
+              (&header()->allocation, allocation
+               , allocation + detail::shared_image_cache_copier + (reuse ? 0u : size)))
+      {
+        if(!reuse)
+          offset = used;
+        generation = current;
+        return true;
+      }
+    }
+  }
+
+  // Starts the data area over in a new generation, if it's still the
+  // one of allocation, unless a live writer other than own's is
+  // copying. Writers that died copying are dropped. Returns false if
+  // it couldn't
+  bool start_over(detail::shared_image_cache_slot const* own, boost::uint64_t allocation)
+  {
+    if(allocation & detail::shared_image_cache_copiers_mask && copying(own))
+      return false;
+    boost::uint64_t next = ((allocation >> detail::shared_image_cache_generation_shift) + 1u)
+      << detail::shared_image_cache_generation_shift;
+    __sync_bool_compare_and_swap(&header()->allocation, allocation, next);
+    return true;
+  }
+
+  void end_copy()
+  {
+    __sync_fetch_and_sub(&header()->allocation, detail::shared_image_cache_copier);
+  }
+
+  // Whether a live process is writing a slot other than own. Writers
+  // make their slot's sequence odd before registering as copying
+  bool copying(detail::shared_image_cache_slot const* own) const
+  {
+    __sync_synchronize();
+    unsigned int count = header()->slot_count;
+    for(unsigned int i = 0; i != count; ++i)
+    {
+      detail::shared_image_cache_slot* slot = slots() + i;
+      boost::uint32_t writer = load(slot->writer);
+      if(slot != own && load(slot->sequence) & 1u && writer && alive(writer))
+        return true;
+    }
+    return false;
+  }
+
+  detail::shared_image_cache_slot* lookup(boost::uint64_t key, bool insert) const
+  {
+    unsigned int count = header()->slot_count;
+    for(unsigned int i = 0; i != count; ++i)
+    {
+      detail::shared_image_cache_slot* slot = slots() + (key + i) % count;
+      boost::uint64_t k = *static_cast<volatile boost::uint64_t*>(&slot->key);
+      if(k == key)
+        return slot;
+      if(!k)
+      {
+        if(!insert)
+          return 0;
+        k = __sync_val_compare_and_swap(&slot->key, boost::uint64_t(0u), key);
+        if(!k || k == key)
+          return slot;
+      }
+    }
+    return 0;
+  }
+
+  detail::shared_image_cache_header* header() const
+  {
+    return static_cast<detail::shared_image_cache_header*>(base);
+  }
+  detail::shared_image_cache_slot* slots() const
+  {
+    return static_cast<detail::shared_image_cache_slot*>
+      (static_cast<void*>(header() + 1));
+  }
+  unsigned char* data() const
+  {
+    return static_cast<unsigned char*>
+      (static_cast<void*>(slots() + header()->slot_count));
+  }
+
+  void* base;
+  std::size_t length;
+  bool writable;
+};
+
+} }
+
+#endif
@@ -0,0 +1,182 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_TEXTURE_ATLAS_HPP
+#define GHTV_OMX_RPI_TEXTURE_ATLAS_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+#include <ghtv/omx-rpi/rectangle_packer.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/optional.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+// Where an image was placed, u/v are normalized texture coordinates
+// of its corners.
+struct atlas_region
+{
+  GLuint texture;
+  unsigned int x, y, width, height;
+  GLfloat u0, v0, u1, v1;
+};
+
+// Packs many small images into a few large RGBA textures, so a
+// renderer can draw all regions of a page with a single bind. All
+// member functions must be called with the owning EGL context current.
+struct texture_atlas : boost::noncopyable
+{
+  texture_atlas(unsigned int page_width = 1024u, unsigned int page_height = 1024u
+                , unsigned int padding = 1u)
+    : page_width(page_width), page_height(page_height), padding(padding)
+  {}
+
+  ~texture_atlas()
+  {
+    for(std::vector<page>::iterator first = pages.begin(), last = pages.end()
+          ; first != last; ++first)
+      glDeleteTextures(1, &first->texture);
+  }
+
+  // Images that don't fit a page, or have no pixels, are refused
+  boost::optional<atlas_region> insert(decoded_image const& image)
+  {
+    assert(image.format == GL_RGBA && image.type == GL_UNSIGNED_BYTE);
+    if(!image.width || !image.height)
+      return boost::none;
+    unsigned int x, y, w = image.width + 2u * padding, h = image.height + 2u * padding;
+
+    std::vector<page>::iterator first = pages.begin(), last = pages.end();
+    while(first != last && !first->packer.insert(w, h, x, y))
+      ++first;
+    if(first == last)
+    {
+      if(w > page_width || h > page_height)
+        return boost::none;
+      first = pages.insert(last, page(page_width, page_height));
+      glGenTextures(1, &first->texture);
+      glBindTexture (GL_TEXTURE_2D, first->texture);
+      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, page_width, page_height
+                    , 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+      bool inserted = first->packer.insert(w, h, x, y);
+      assert(inserted);
+      static_cast<void>(inserted);
+    }
+    else
+      glBindTexture (GL_TEXTURE_2D, first->texture);
+    x += padding;
+    y += padding;
+
+    // RGBA rows, the padding's included, are 4 byte aligned whatever
+    // an upload before asked for
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    // GLES2 has no GL_UNPACK_ROW_LENGTH, rows with padding are
+    // uploaded one by one
+    if(image.stride == image.width * 4)
+      glTexSubImage2D (GL_TEXTURE_2D, 0, x, y, image.width, image.height
+                       , GL_RGBA, GL_UNSIGNED_BYTE, &image.pixels[0]);
+    else
+      for(unsigned int row = 0; row != image.height; ++row)
+        glTexSubImage2D (GL_TEXTURE_2D, 0, x, y + row, image.width, 1
+                         , GL_RGBA, GL_UNSIGNED_BYTE, image.row(row));
+    pad(image, x, y);
+
+    atlas_region region = {first->texture, x, y, image.width, image.height
+                           , GLfloat(x) / page_width, GLfloat(y) / page_height
+                           , GLfloat(x + image.width) / page_width
+                           , GLfloat(y + image.height) / page_height};
+    return region;
+  }
+
+  // Forgets all regions, keeping the textures for reuse
+  void clear()
+  {
+    for(std::vector<page>::iterator first = pages.begin(), last = pages.end()
+          ; first != last; ++first)
+      first->packer.clear();
+  }
+
+  std::size_t page_count() const { return pages.size(); }
+
+  unsigned int page_width, page_height, padding;
+private:
+  // The page's texels are undefined until written, and linear
+  // filtering at an image's edges samples past them, so the padding
+  // on each side of it repeats its outer column or row, corners
+  // included
+  void pad(decoded_image const& image, unsigned int x, unsigned int y)
+  {
+    if(!padding)
+      return;
+    unsigned int const width = image.width + 2u * padding;
+    edges.resize(std::size_t((std::max)(image.height, width)) * padding * 4u);
+
+    for(int side = 0; side != 2; ++side)
+    {
+      unsigned int column = side ? image.width - 1u : 0u;
+      for(unsigned int row = 0; row != image.height; ++row)
+        for(unsigned int i = 0; i != padding; ++i)
+          std::memcpy(&edges[(row * padding + i) * 4u], image.row(row) + column * 4u, 4u);
+      glTexSubImage2D (GL_TEXTURE_2D, 0, side ? x + image.width : x - padding, y
+                       , padding, image.height, GL_RGBA, GL_UNSIGNED_BYTE, &edges[0]);
+    }
+
+    for(int side = 0; side != 2; ++side)
+    {
+      unsigned char const* edge = image.row(side ? image.height - 1u : 0u);
+      for(unsigned int i = 0; i != padding; ++i)
+      {
+        unsigned char* row = &edges[i * width * 4u];
+        for(unsigned int j = 0; j != padding; ++j)
+        {
+          std::memcpy(row + j * 4u, edge, 4u);
+          std::memcpy(row + (padding + image.width + j) * 4u, edge + (image.width - 1u) * 4u, 4u);
+        }
+        std::memcpy(row + padding * 4u, edge, image.width * 4u);
+      }
+      glTexSubImage2D (GL_TEXTURE_2D, 0, x - padding, side ? y + image.height : y - padding
+                       , width, padding, GL_RGBA, GL_UNSIGNED_BYTE, &edges[0]);
+    }
+  }
+
+  struct page
+  {
+    page(unsigned int width, unsigned int height)
+      : texture(0u), packer(width, height) {}
+
+    GLuint texture;
+    rectangle_packer packer;
+  };
+
+  std::vector<page> pages;
+  // Scratch for pad
+  std::vector<unsigned char> edges;
+};
+
+} }
+
+#endif
@@ -0,0 +1,189 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_TILED_IMAGE_HPP
+#define GHTV_OMX_RPI_TILED_IMAGE_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <boost/noncopyable.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+// One texture of a tiled_image, x and y are in image coordinates
+struct image_tile
+{
+  GLuint texture;
+  unsigned int x, y, width, height;
+};
+
+// An image split in textures of at most tile_size x tile_size, for
+// images larger than the maximum texture size. Rows are received
+// top to bottom and a tile row is uploaded as soon as it is
+// complete, so only one band of tile_size rows is kept in memory.
+// When a region is set, only the tiles covering it are created.
+// All member functions must be called with the owning EGL context
+// current.
+struct tiled_image : boost::noncopyable
+{
+  tiled_image(unsigned int tile_size = 512u)
+    : width(0u), height(0u), tile_size(tile_size), has_region(false)
+    , region_x(0u), region_y(0u), region_width(0u), region_height(0u)
+    , band_y(0u), band_height(0u), band_rows(0u)
+  {}
+
+  ~tiled_image()
+  {
+    clear();
+  }
+
+  void set_region(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+  {
+    has_region = true;
+    requested_x = x;
+    requested_y = y;
+    requested_width = w;
+    requested_height = h;
+  }
+
+  void clear_region()
+  {
+    has_region = false;
+  }
+
+  void clear()
+  {
+    for(std::vector<image_tile>::iterator first = tiles.begin(), last = tiles.end()
+          ; first != last; ++first)
+      glDeleteTextures(1, &first->texture);
+    tiles.clear();
+  }
+
+  void begin(unsigned int image_width, unsigned int image_height)
+  {
+    clear();
+    width = image_width;
+    height = image_height;
+
+    GLint max_size = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+    if(max_size > 0)
+      tile_size = (std::min)(tile_size, unsigned(max_size));
+
+    region_x = region_y = 0u;
+    region_width = width;
+    region_height = height;
+    if(has_region)
+    {
+      region_x = (std::min)(requested_x, width);
+      region_y = (std::min)(requested_y, height);
+      region_width = (std::min)(requested_width, width - region_x);
+      region_height = (std::min)(requested_height, height - region_y);
+    }
+
+    band_y = region_y;
+    band_rows = 0u;
+    band_height = (std::min)(tile_size, region_height);
+    band.resize(std::size_t(region_width) * tile_size * 4u);
+  }
+
+  // rgba holds rows of the whole image width, starting at first_row
+  void add_rows(unsigned int first_row, unsigned int rows
+                , unsigned char const* rgba, unsigned int stride)
+  {
+    for(unsigned int row = first_row; row != first_row + rows; ++row
+          , rgba += stride)
+    {
+      if(row < band_y || complete())
+        continue;
+
+      unsigned int band_row = row - band_y;
+      // The band is stored tile by tile, so each tile is contiguous
+      for(unsigned int tile_x = 0; tile_x < region_width; tile_x += tile_size)
+      {
+        unsigned int w = (std::min)(tile_size, region_width - tile_x);
+        std::memcpy(&band[(std::size_t(tile_x) * band_height + band_row * w) * 4u]
+                    , rgba + (region_x + tile_x) * 4u, w * 4u);
+      }
+
+      if(++band_rows == band_height)
+        upload_band();
+    }
+  }
+
+  bool complete() const
+  {
+    return band_y >= region_y + region_height;
+  }
+
+  // Uploads a whole decoded image
+  void upload(decoded_image const& image)
+  {
+    assert(image.format == GL_RGBA && image.type == GL_UNSIGNED_BYTE);
+    begin(image.width, image.height);
+    if(!image.pixels.empty())
+      add_rows(0u, image.height, &image.pixels[0], image.stride);
+  }
+
+  // Last row of the region, rows after it need not be decoded
+  unsigned int last_row() const
+  {
+    return region_y + region_height;
+  }
+
+  unsigned int width, height, tile_size;
+  std::vector<image_tile> tiles;
+private:
+  void upload_band()
+  {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    for(unsigned int tile_x = 0; tile_x < region_width; tile_x += tile_size)
+    {
+      unsigned int w = (std::min)(tile_size, region_width - tile_x);
+      image_tile tile = {0u, region_x + tile_x, band_y, w, band_height};
+      glGenTextures(1, &tile.texture);
+      glBindTexture (GL_TEXTURE_2D, tile.texture);
+      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+      glTexImage2D (GL_TEXTURE_2D, 0, GL_RGBA, w, band_height, 0, GL_RGBA, GL_UNSIGNED_BYTE
+                    , &band[std::size_t(tile_x) * band_height * 4u]);
+      tiles.push_back(tile);
+    }
+
+    band_y += band_height;
+    band_rows = 0u;
+    band_height = (std::min)(tile_size, region_y + region_height - band_y);
+  }
+
+  bool has_region;
+  unsigned int requested_x, requested_y, requested_width, requested_height;
+  unsigned int region_x, region_y, region_width, region_height;
+  unsigned int band_y, band_height, band_rows;
+  std::vector<unsigned char> band;
+};
+
+} }
+
+#endif
@@ -0,0 +1,158 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_YUV_TEXTURE_HPP
+#define GHTV_OMX_RPI_YUV_TEXTURE_HPP
+
+#include <ghtv/omx-rpi/decoded_image.hpp>
+
+#include <GLES2/gl2.h>
+
+#include <cstring>
+#include <cassert>
+
+namespace ghtv { namespace omx_rpi {
+
+// A YUV420 image packed into a single GL_LUMINANCE texture, a byte and
+// a half per pixel instead of the four of RGBA: the Y plane on top,
+// then the U and V planes side by side below it, at half resolution.
+// Odd widths are padded with a copy of the last column, so the
+// texture is twice the chroma width wide.
+//
+//   +-------+
+//   |   Y   |  height rows
+//   +---+---+
+//   | U | V |  (height + 1) / 2 rows
+//   +---+---+
+//
+// The fragment shader snippet below converts it back to RGB.
+struct yuv_texture_layout
+{
+  // False when the image didn't decode to YUV, as PNGs do, and the
+  // texture is plain RGBA
+  bool planar;
+  // Of the image, not of the texture, which is a column wider for odd
+  // widths and taller by the chroma planes
+  unsigned int width;
+  unsigned int height;
+  // Uniforms of the shader snippet
+  float luma_height;
+  float texel_size[2];
+
+  yuv_texture_layout()
+    : planar(false), width(0u), height(0u), luma_height(1.0f)
+  {
+    texel_size[0] = texel_size[1] = 0.0f;
+  }
+
+  // From the dimensions of a texture as decoded_image describes it.
+  // The padding doesn't tell odd widths apart, image_width does; 0
+  // takes the texture's width
+  yuv_texture_layout(unsigned int texture_width, unsigned int texture_height, GLenum format
+                     , unsigned int image_width = 0u)
+    : planar(format == GL_LUMINANCE), width(image_width ? image_width : texture_width)
+    , height(texture_height), luma_height(1.0f)
+  {
+    assert(width <= texture_width && (!planar || width + 1u >= texture_width));
+    texel_size[0] = 1.0f / texture_width;
+    texel_size[1] = 1.0f / texture_height;
+    if(planar)
+    {
+      height = texture_height - (texture_height + 1u) / 3u;
+      luma_height = float(height) / texture_height;
+    }
+  }
+};
+
+// Defines vec3 ghtv_yuv_to_rgb(vec2 texcoord) for a fragment shader,
+// texcoord spanning the image from 0 to 1. BT.601 full range, as JPEG
+// stores it and the CPU conversion assumes. The
+// coordinates are kept half a texel inside each plane, so linear
+// filtering doesn't blend neighbouring planes.
+char const yuv_fragment_shader_source[] =
+  "uniform sampler2D ghtv_yuv_texture;\n"
+  "uniform float ghtv_yuv_luma_height;\n"
+  "uniform vec2 ghtv_yuv_texel_size;\n"
+  "vec3 ghtv_yuv_to_rgb(vec2 texcoord)\n"
+  "{\n"
+  "  vec2 half_texel = 0.5 * ghtv_yuv_texel_size;\n"
+  "  vec2 luma = vec2(texcoord.x, min(texcoord.y * ghtv_yuv_luma_height\n"
+  "                                   , ghtv_yuv_luma_height - half_texel.y));\n"
+  "  vec2 chroma = vec2(clamp(texcoord.x * 0.5, half_texel.x, 0.5 - half_texel.x)\n"
+  "                     , clamp(ghtv_yuv_luma_height + texcoord.y * (1.0 - ghtv_yuv_luma_height)\n"
+  "                             , ghtv_yuv_luma_height + half_texel.y, 1.0 - half_texel.y));\n"
+  "  vec3 yuv = vec3(texture2D(ghtv_yuv_texture, luma).r\n"
+  "                  , texture2D(ghtv_yuv_texture, chroma).r - 0.5\n"
+  "                  , texture2D(ghtv_yuv_texture, chroma + vec2(0.5, 0.0)).r - 0.5);\n"
+  "  return mat3(1.0, 1.0, 1.0, 0.0, -0.344136, 1.772, 1.402, -0.714136, 0.0) * yuv;\n"
+  "}\n";
+
+// Sets the snippet's uniforms on program, which must be in use. The
+// texture goes in unit
+inline void set_yuv_uniforms(GLuint program, yuv_texture_layout const& layout, GLint unit = 0)
+{
+  glUniform1i(glGetUniformLocation(program, "ghtv_yuv_texture"), unit);
+  glUniform1f(glGetUniformLocation(program, "ghtv_yuv_luma_height"), layout.luma_height);
+  glUniform2f(glGetUniformLocation(program, "ghtv_yuv_texel_size")
+              , layout.texel_size[0], layout.texel_size[1]);
+}
+
+namespace detail {
+
+// Sizes image for the packed layout of a width by height YUV420 image
+inline void begin_yuv_texture(decoded_image& image, unsigned int width, unsigned int height)
+{
+  image.width = (width + 1u) / 2u * 2u;
+  image.height = height + (height + 1u) / 2u;
+  image.stride = image.width;
+  image.format = GL_LUMINANCE;
+  image.type = GL_UNSIGNED_BYTE;
+  image.pixels.resize(image.stride * image.height);
+}
+
+// Copies one slice of OMX_COLOR_FormatYUV420PackedPlanar, laid out as
+// yuv420_slice_to_rgba reads it, into the packed layout. first_row is
+// the luma row the slice starts at, even as slice heights are
+inline void yuv420_slice_to_packed(unsigned char const* slice, unsigned int in_stride
+                                   , unsigned int slice_height
+                                   , unsigned int width, unsigned int height
+                                   , unsigned int first_row, unsigned int rows
+                                   , decoded_image& image)
+{
+  unsigned char const* y_plane = slice;
+  unsigned char const* u_plane = y_plane + in_stride * slice_height;
+  unsigned char const* v_plane = u_plane + (in_stride/2) * (slice_height/2);
+  unsigned int chroma_width = image.width / 2u;
+  for(unsigned int row = 0; row != rows; ++row)
+  {
+    unsigned char* out = image.row(first_row + row);
+    std::memcpy(out, y_plane + row * in_stride, width);
+    if(width != image.width)
+      out[width] = out[width - 1u];
+  }
+  for(unsigned int row = 0; row != (rows + 1u) / 2u; ++row)
+  {
+    unsigned char* out = image.row(height + first_row / 2u + row);
+    std::memcpy(out, u_plane + row * (in_stride/2), chroma_width);
+    std::memcpy(out + chroma_width, v_plane + row * (in_stride/2), chroma_width);
+  }
+}
+
+}
+
+} }
+
+#endif
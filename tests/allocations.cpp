@@ -0,0 +1,100 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Loads the same image repeatedly into a texture and checks that,
+// once the pipeline's storage has grown to fit, a load does not
+// allocate. Needs the Raspberry Pi's OMX components.
+
+#include <bcm_host.h>
+
+#include <ghtv/omx-rpi/image_pipeline.hpp>
+
+#include "egl_pbuffer.hpp"
+
+#include <boost/bind.hpp>
+
+#include <iostream>
+#include <string>
+#include <new>
+#include <cstdlib>
+#include <cassert>
+
+unsigned long allocations = 0;
+
+void* operator new(std::size_t size) throw(std::bad_alloc)
+{
+  __sync_fetch_and_add(&allocations, 1ul);
+  if(void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) throw(std::bad_alloc)
+{
+  return operator new(size);
+}
+void operator delete(void* p) throw()
+{
+  std::free(p);
+}
+void operator delete[](void* p) throw()
+{
+  std::free(p);
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 2)
+  {
+    std::cout << "usage: allocations <image>" << std::endl;
+    return 1;
+  }
+
+  bcm_host_init();
+  std::atexit(bcm_host_deinit);
+
+  EGLDisplay display;
+  EGLContext context;
+  if(!make_pbuffer_current(display, context))
+    return 1;
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+
+  // Converting argv[1] on every load would allocate
+  std::string const file = argv[1];
+  ghtv::omx_rpi::image_pipeline pipeline;
+  int const warm_up = 2, loads = 10;
+  unsigned long before = 0;
+  for(int i = 0; i != warm_up + loads; ++i)
+  {
+    if(i == warm_up)
+      before = allocations;
+
+    ghtv::omx_rpi::image_pipeline::load_completion completion;
+    pipeline.load_image(file, texture, &display, &context
+                        , boost::bind(&ghtv::omx_rpi::image_pipeline::load_completion::signal
+                                      , &completion, _1));
+    bool success = completion.wait();
+    pipeline.reset();
+    assert(success);
+    static_cast<void>(success);
+  }
+  unsigned long steady = allocations - before;
+
+  std::cout << "allocations per load: " << double(steady) / loads << std::endl;
+  assert(steady == 0);
+  return steady == 0 ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GHTV_OMX_RPI_TESTS_EGL_PBUFFER_HPP
+#define GHTV_OMX_RPI_TESTS_EGL_PBUFFER_HPP
+
+#include <EGL/egl.h>
+
+#include <iostream>
+
+// Makes a GLES2 context current on a 1x1 pbuffer of the default
+// display, for the tests that load into textures but show nothing.
+// Returns false, saying why, if it couldn't
+inline bool make_pbuffer_current(EGLDisplay& display, EGLContext& context)
+{
+  display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  EGLint major, minor;
+  if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+  {
+    std::cout << "Failed initializing display" << std::endl;
+    return false;
+  }
+
+  EGLint const attribs[] =
+    {
+      EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8
+      , EGL_SURFACE_TYPE, EGL_PBUFFER_BIT
+      , EGL_NONE
+    };
+  EGLConfig config;
+  EGLint configs;
+  if(!eglChooseConfig(display, attribs, &config, 1, &configs) || !configs)
+  {
+    std::cout << "Choosing config failed" << std::endl;
+    return false;
+  }
+  eglBindAPI(EGL_OPENGL_ES_API);
+
+  EGLint context_attributes[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, context_attributes);
+  EGLint surface_attributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+  EGLSurface surface = eglCreatePbufferSurface(display, config, surface_attributes);
+  if(eglMakeCurrent(display, surface, surface, context) == EGL_FALSE)
+  {
+    std::cout << "Failed making current surface" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,90 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Encodes a generated image repeatedly and checks that, once the
+// first encode took its buffers, the next ones of the same size reuse
+// them from the pool instead of allocating. Needs the Raspberry Pi's
+// OMX components.
+
+#include <bcm_host.h>
+
+#include <ghtv/omx-rpi/image_encoder.hpp>
+
+#include <iostream>
+#include <cstdlib>
+#include <cassert>
+
+void fill(ghtv::omx_rpi::decoded_image& image, unsigned int width, unsigned int height)
+{
+  image.width = width;
+  image.height = height;
+  image.stride = width * 4u;
+  image.format = GL_RGBA;
+  image.type = GL_UNSIGNED_BYTE;
+  image.pixels.resize(image.stride * height);
+  for(unsigned int y = 0; y != height; ++y)
+    for(unsigned int x = 0; x != width; ++x)
+    {
+      unsigned char* p = image.row(y) + x * 4u;
+      p[0] = x * 255u / width;
+      p[1] = y * 255u / height;
+      p[2] = 128u;
+      p[3] = 255u;
+    }
+}
+
+bool is_jpeg(std::vector<unsigned char> const& jpeg)
+{
+  return jpeg.size() > 4u && jpeg[0] == 0xFF && jpeg[1] == 0xD8
+    && jpeg[jpeg.size() - 2u] == 0xFF && jpeg[jpeg.size() - 1u] == 0xD9;
+}
+
+int main()
+{
+  bcm_host_init();
+  std::atexit(bcm_host_deinit);
+
+  ghtv::omx_rpi::input_buffer_pool& pool = ghtv::omx_rpi::input_buffer_pool::instance();
+  pool.set_idle_timeout(boost::posix_time::minutes(1));
+  pool.trim();
+
+  ghtv::omx_rpi::image_encoder encoder;
+  ghtv::omx_rpi::decoded_image image;
+  std::vector<unsigned char> jpeg;
+
+  fill(image, 320u, 240u);
+  bool encoded = encoder.encode(image, jpeg);
+  assert(encoded && is_jpeg(jpeg));
+  // Given back once the encode is done
+  std::size_t kept = pool.idle_bytes();
+  assert(kept != 0u);
+
+  for(int i = 0; i != 5; ++i)
+  {
+    encoded = encoder.encode(image, jpeg);
+    assert(encoded && is_jpeg(jpeg));
+    assert(pool.idle_bytes() == kept);
+  }
+
+  // A smaller image fits in the same buffers
+  fill(image, 200u, 100u);
+  encoded = encoder.encode(image, jpeg);
+  assert(encoded && is_jpeg(jpeg));
+  assert(pool.idle_bytes() == kept);
+
+  std::cout << "buffer memory kept: " << kept << " bytes" << std::endl;
+  return encoded ? 0 : 1;
+}
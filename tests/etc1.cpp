@@ -0,0 +1,146 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/etc1.hpp>
+
+#include <cassert>
+#include <cstdlib>
+
+// Reference decoder, straight from the OES_compressed_ETC1_RGB8_texture
+// specification
+void decode_block(unsigned char const* b, unsigned char* rgb /* 4x4x3 */)
+{
+  boost::uint64_t bits = 0u;
+  for(int i = 0; i != 8; ++i)
+    bits = bits << 8 | b[i];
+  bool differential = bits >> 33 & 1u, flip = bits >> 32 & 1u;
+  int base[2][3];
+  for(int c = 0; c != 3; ++c)
+  {
+    int shift = 59 - c * 8;
+    if(differential)
+    {
+      int c0 = bits >> shift & 31, d = bits >> (shift - 3) & 7;
+      int c1 = c0 + (d >= 4 ? d - 8 : d);
+      assert(c1 >= 0 && c1 < 32);
+      base[0][c] = ghtv::omx_rpi::detail::etc1_expand5(c0);
+      base[1][c] = ghtv::omx_rpi::detail::etc1_expand5(c1);
+    }
+    else
+    {
+      base[0][c] = ghtv::omx_rpi::detail::etc1_expand4(bits >> (shift + 1) & 15);
+      base[1][c] = ghtv::omx_rpi::detail::etc1_expand4(bits >> (shift - 3) & 15);
+    }
+  }
+  int table[2] = {int(bits >> 37 & 7), int(bits >> 34 & 7)};
+  for(int x = 0; x != 4; ++x)
+    for(int y = 0; y != 4; ++y)
+    {
+      int position = x * 4 + y, sub = flip ? y / 2 : x / 2;
+      int index = (bits >> (16 + position) & 1) << 1 | (bits >> position & 1);
+      int modifier = ghtv::omx_rpi::detail::etc1_modifiers[table[sub]][index];
+      for(int c = 0; c != 3; ++c)
+      {
+        int v = base[sub][c] + modifier;
+        rgb[(y * 4 + x) * 3 + c] = v < 0 ? 0 : v > 255 ? 255 : v;
+      }
+    }
+}
+
+// Mean squared error over the image
+double encode_decode(ghtv::omx_rpi::decoded_image const& image, unsigned int threads)
+{
+  ghtv::omx_rpi::decoded_image compressed;
+  ghtv::omx_rpi::etc1_encode(image, compressed, threads);
+  assert(compressed.format == GL_ETC1_RGB8_OES);
+  assert(compressed.stride == (image.width + 3u) / 4u * 8u);
+  assert(compressed.pixels.size() == compressed.stride * ((image.height + 3u) / 4u));
+
+  double error = 0.0;
+  unsigned char rgb[48];
+  for(unsigned int by = 0; by != (image.height + 3u) / 4u; ++by)
+    for(unsigned int bx = 0; bx != (image.width + 3u) / 4u; ++bx)
+    {
+      decode_block(&compressed.pixels[by * compressed.stride + bx * 8u], rgb);
+      for(unsigned int y = 0; y != 4u && by * 4u + y < image.height; ++y)
+        for(unsigned int x = 0; x != 4u && bx * 4u + x < image.width; ++x)
+          for(int c = 0; c != 3; ++c)
+          {
+            double d = double(rgb[(y * 4u + x) * 3u + c])
+              - image.row(by * 4u + y)[(bx * 4u + x) * 4u + c];
+            error += d * d;
+          }
+    }
+  return error / (image.width * image.height * 3.0);
+}
+
+ghtv::omx_rpi::decoded_image make_image(unsigned int width, unsigned int height)
+{
+  ghtv::omx_rpi::decoded_image image;
+  image.width = width;
+  image.height = height;
+  image.stride = width * 4u;
+  image.format = GL_RGBA;
+  image.type = GL_UNSIGNED_BYTE;
+  image.pixels.resize(image.stride * height);
+  return image;
+}
+
+int main()
+{
+  {
+    // A flat color is reproduced almost exactly
+    ghtv::omx_rpi::decoded_image image = make_image(16, 16);
+    for(std::size_t i = 0; i != image.pixels.size(); i += 4u)
+    {
+      image.pixels[i] = 200;
+      image.pixels[i + 1] = 100;
+      image.pixels[i + 2] = 30;
+      image.pixels[i + 3] = 255;
+    }
+    double error = encode_decode(image, 1u);
+    assert(error < 4.0);
+    static_cast<void>(error);
+  }
+
+  {
+    // A smooth gradient, with edge blocks, stays close to the source
+    ghtv::omx_rpi::decoded_image image = make_image(70, 45);
+    for(unsigned int y = 0; y != image.height; ++y)
+      for(unsigned int x = 0; x != image.width; ++x)
+      {
+        unsigned char* p = &image.pixels[y * image.stride + x * 4u];
+        p[0] = x * 255u / image.width;
+        p[1] = y * 255u / image.height;
+        p[2] = 128;
+        p[3] = 255;
+      }
+    double error = encode_decode(image, 1u);
+    assert(error < 16.0);
+    static_cast<void>(error);
+  }
+
+  {
+    // Threads split the work without changing the result
+    ghtv::omx_rpi::decoded_image image = make_image(64, 64), a, b;
+    std::srand(1);
+    for(std::size_t i = 0; i != image.pixels.size(); ++i)
+      image.pixels[i] = std::rand() % 256;
+    ghtv::omx_rpi::etc1_encode(image, a, 1u);
+    ghtv::omx_rpi::etc1_encode(image, b, 4u);
+    assert(a.pixels == b.pixels);
+  }
+}
@@ -0,0 +1,193 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/image_header.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+
+// A TIFF structure, as in an EXIF APP1 segment after "Exif\0\0", whose
+// IFD0 has an Orientation entry between two others
+std::vector<unsigned char> exif_tiff(unsigned int orientation, bool big_endian)
+{
+  std::vector<unsigned char> tiff;
+  struct put
+  {
+    std::vector<unsigned char>& out;
+    bool big_endian;
+    void u16(unsigned int v)
+    {
+      unsigned char b[2] = {(unsigned char)(v >> 8), (unsigned char)v};
+      if(!big_endian)
+        std::swap(b[0], b[1]);
+      out.insert(out.end(), b, b + 2);
+    }
+    void u32(boost::uint32_t v)
+    {
+      u16(big_endian ? v >> 16 : v & 0xFFFFu);
+      u16(big_endian ? v & 0xFFFFu : v >> 16);
+    }
+    void entry(unsigned int tag, unsigned int type, unsigned int value)
+    {
+      u16(tag);
+      u16(type);
+      u32(1u);
+      // A SHORT sits in the first two bytes of the value field
+      if(type == 3u)
+      {
+        u16(value);
+        u16(0u);
+      }
+      else
+        u32(value);
+    }
+  } p = {tiff, big_endian};
+
+  tiff.push_back(big_endian ? 'M' : 'I');
+  tiff.push_back(big_endian ? 'M' : 'I');
+  p.u16(42u);
+  p.u32(8u);
+  p.u16(3u);
+  p.entry(0x010F, 2u, 0u); // Make, empty
+  p.entry(0x0112, 3u, orientation);
+  p.entry(0x011A, 5u, 0u); // XResolution, offset unused
+  p.u32(0u);
+  return tiff;
+}
+
+// A JPEG with the EXIF block and a frame header of width by height,
+// cut before the scan, which is all probe_image_header reads
+std::vector<unsigned char> exif_jpeg(std::vector<unsigned char> const& tiff
+                                     , unsigned int width, unsigned int height)
+{
+  unsigned char const soi[] = {0xFF, 0xD8};
+  std::vector<unsigned char> jpeg(soi, soi + 2);
+  unsigned int length = 2u + 6u + tiff.size();
+  unsigned char const app1[] = {0xFF, 0xE1, (unsigned char)(length >> 8), (unsigned char)length
+                                , 'E', 'x', 'i', 'f', 0, 0};
+  jpeg.insert(jpeg.end(), app1, app1 + sizeof app1);
+  jpeg.insert(jpeg.end(), tiff.begin(), tiff.end());
+  unsigned char const sof0[] = {0xFF, 0xC0, 0, 11, 8, (unsigned char)(height >> 8), (unsigned char)height
+                                , (unsigned char)(width >> 8), (unsigned char)width, 1, 1, 0x11, 0};
+  jpeg.insert(jpeg.end(), sof0, sof0 + sizeof sof0);
+  unsigned char const sos[] = {0xFF, 0xDA, 0, 8, 1, 1, 0, 0, 63, 0};
+  jpeg.insert(jpeg.end(), sos, sos + sizeof sos);
+  return jpeg;
+}
+
+unsigned int orientation_of(std::vector<unsigned char> const& tiff)
+{
+  ghtv::omx_rpi::detail::tiff_reader reader = {&tiff[0], tiff.size(), tiff[0] == 'M'};
+  ghtv::omx_rpi::detail::exif_orientation_entries ifd0 = {0u};
+  reader.for_each_entry(reader.u32(4u), ifd0);
+  return ifd0.orientation;
+}
+
+// Where the pixel at x, y of a width by height image stored with
+// orientation goes once displayed, from the sides the EXIF
+// specification puts its first row and column on
+void displayed(unsigned int orientation, unsigned int width, unsigned int height
+               , unsigned int x, unsigned int y, unsigned int& dx, unsigned int& dy)
+{
+  switch(orientation)
+  {
+  case 1: dx = x; dy = y; break;                                   // Top, left
+  case 2: dx = width - 1u - x; dy = y; break;                      // Top, right
+  case 3: dx = width - 1u - x; dy = height - 1u - y; break;        // Bottom, right
+  case 4: dx = x; dy = height - 1u - y; break;                     // Bottom, left
+  case 5: dx = y; dy = x; break;                                   // Left, top
+  case 6: dx = height - 1u - y; dy = x; break;                     // Right, top
+  case 7: dx = height - 1u - y; dy = width - 1u - x; break;        // Right, bottom
+  case 8: dx = y; dy = width - 1u - x; break;                      // Left, bottom
+  }
+}
+
+// The same as image_transform describes it: mirrored first, then
+// rotated clockwise
+void transformed(ghtv::omx_rpi::image_transform const& t, unsigned int width, unsigned int height
+                 , unsigned int x, unsigned int y, unsigned int& dx, unsigned int& dy)
+{
+  if(t.mirror)
+    x = width - 1u - x;
+  switch(t.rotation)
+  {
+  case 0: dx = x; dy = y; break;
+  case 90: dx = height - 1u - y; dy = x; break;
+  case 180: dx = width - 1u - x; dy = height - 1u - y; break;
+  case 270: dx = y; dy = width - 1u - x; break;
+  default: assert(false);
+  }
+}
+
+int main()
+{
+  char path[] = "/tmp/omx-rpi-exif-XXXXXX";
+  int fd = ::mkstemp(path);
+  assert(fd >= 0);
+
+  for(unsigned int orientation = 1u; orientation <= 8u; ++orientation)
+  {
+    for(int big_endian = 0; big_endian != 2; ++big_endian)
+    {
+      std::vector<unsigned char> tiff = exif_tiff(orientation, big_endian);
+      assert(orientation_of(tiff) == orientation);
+
+      std::vector<unsigned char> jpeg = exif_jpeg(tiff, 40u, 30u);
+      bool written = ::ftruncate(fd, 0) == 0
+        && ::pwrite(fd, &jpeg[0], jpeg.size(), 0) == (ssize_t)jpeg.size();
+      assert(written);
+      static_cast<void>(written);
+      ghtv::omx_rpi::image_header header;
+      bool probed = ghtv::omx_rpi::probe_image_header(fd, header);
+      assert(probed && header.coding == ghtv::omx_rpi::coding_jpeg);
+      assert(header.orientation == orientation && header.width == 40u && header.height == 30u);
+      static_cast<void>(probed);
+    }
+
+    // Every pixel of a stored 3x2 image lands where the specification
+    // displays it
+    ghtv::omx_rpi::image_transform t = ghtv::omx_rpi::image_transform::from_exif_orientation(orientation);
+    assert(!t.exif && t.transposes() == (orientation >= 5u));
+    assert(t.identity() == (orientation == 1u));
+    for(unsigned int y = 0; y != 2u; ++y)
+      for(unsigned int x = 0; x != 3u; ++x)
+      {
+        unsigned int ex = 0, ey = 0, tx = 1, ty = 1;
+        displayed(orientation, 3u, 2u, x, y, ex, ey);
+        transformed(t, 3u, 2u, x, y, tx, ty);
+        assert(ex == tx && ey == ty);
+      }
+  }
+
+  // Out of range values leave the image upright
+  {
+    std::vector<unsigned char> jpeg = exif_jpeg(exif_tiff(9u, false), 40u, 30u);
+    bool written = ::ftruncate(fd, 0) == 0
+      && ::pwrite(fd, &jpeg[0], jpeg.size(), 0) == (ssize_t)jpeg.size();
+    assert(written);
+    static_cast<void>(written);
+    ghtv::omx_rpi::image_header header;
+    ghtv::omx_rpi::probe_image_header(fd, header);
+    assert(header.orientation == 1u);
+    assert(ghtv::omx_rpi::image_transform::from_exif_orientation(0u).identity());
+  }
+
+  ::close(fd);
+  std::remove(path);
+}
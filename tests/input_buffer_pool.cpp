@@ -0,0 +1,83 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/input_buffer_pool.hpp>
+
+#include <cassert>
+
+typedef ghtv::omx_rpi::input_buffer_pool::buffer buffer;
+
+int main()
+{
+  ghtv::omx_rpi::input_buffer_pool pool;
+
+  {
+    // A released buffer is reused for the same size or a smaller one,
+    // unless it would waste most of it
+    buffer a, b, c;
+    bool acquired = pool.acquire(64u * 1024u, 16u, a);
+    assert(acquired && a.size == 64u * 1024u && reinterpret_cast<std::size_t>(a.data) % 16u == 0u);
+    pool.release(a);
+    assert(pool.idle_bytes() == 64u * 1024u);
+
+    acquired = pool.acquire(32u * 1024u, 16u, b);
+    assert(acquired && b.data == a.data && b.size == a.size);
+    assert(pool.idle_bytes() == 0u);
+    pool.release(b);
+
+    acquired = pool.acquire(8u * 1024u, 16u, c);
+    assert(acquired && c.data != a.data && c.size == 8u * 1024u);
+    assert(pool.idle_bytes() == 64u * 1024u);
+    pool.release(c);
+
+    // The smallest that fits is taken
+    acquired = pool.acquire(8u * 1024u, 16u, c);
+    assert(acquired && c.size == 8u * 1024u);
+    pool.release(c);
+  }
+
+  {
+    // Over the high watermark the oldest idle buffers are freed down
+    // to the low one
+    pool.trim();
+    pool.set_watermarks(100u * 1024u, 40u * 1024u);
+    buffer b[3];
+    for(int i = 0; i != 3; ++i)
+    {
+      bool acquired = pool.acquire(32u * 1024u, 16u, b[i]);
+      assert(acquired);
+    }
+    pool.release(b[0]);
+    pool.release(b[1]);
+    pool.release(b[2]);
+    assert(pool.idle_bytes() == 96u * 1024u);
+
+    pool.set_watermarks(64u * 1024u, 32u * 1024u);
+    assert(pool.idle_bytes() == 32u * 1024u);
+    buffer left;
+    bool acquired = pool.acquire(32u * 1024u, 16u, left);
+    assert(acquired && left.data == b[2].data);
+    pool.release(left);
+  }
+
+  {
+    // Idle buffers are freed once their timeout expires
+    pool.set_idle_timeout(boost::posix_time::milliseconds(20));
+    for(int i = 0; i != 500 && pool.idle_bytes(); ++i)
+      boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+    assert(pool.idle_bytes() == 0u);
+  }
+}
@@ -0,0 +1,90 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/load_admission.hpp>
+
+#include <boost/thread/thread.hpp>
+#include <boost/bind.hpp>
+
+#include <vector>
+#include <cassert>
+
+boost::mutex order_mutex;
+std::vector<int> order;
+
+void load(ghtv::omx_rpi::load_admission& admission, std::size_t cost, int id)
+{
+  ghtv::omx_rpi::load_admission::reservation reservation(admission, cost);
+  boost::unique_lock<boost::mutex> l(order_mutex);
+  order.push_back(id);
+}
+
+// Waits until n loads are queued
+void wait_queued(ghtv::omx_rpi::load_admission& admission, std::size_t n)
+{
+  while(admission.get_metrics().queued != n)
+    boost::this_thread::sleep(boost::posix_time::milliseconds(1));
+}
+
+int main()
+{
+  ghtv::omx_rpi::load_admission admission(100u);
+
+  {
+    // Within the budget loads don't wait
+    ghtv::omx_rpi::load_admission::reservation a(admission, 60u), b(admission, 40u);
+    ghtv::omx_rpi::load_admission::metrics m = admission.get_metrics();
+    assert(m.in_flight_cost == 100u && m.admitted == 2u && m.blocked == 0u);
+  }
+  assert(admission.get_metrics().in_flight_cost == 0u);
+
+  {
+    // Over the budget they wait, in the order they asked, a small one
+    // behind a large one included
+    boost::thread_group threads;
+    {
+      ghtv::omx_rpi::load_admission::reservation a(admission, 70u);
+      threads.create_thread(boost::bind(&load, boost::ref(admission), 50u, 1));
+      wait_queued(admission, 1u);
+      threads.create_thread(boost::bind(&load, boost::ref(admission), 10u, 2));
+      wait_queued(admission, 2u);
+      assert(order.empty());
+    }
+    threads.join_all();
+    assert(order.size() == 2u && order[0] == 1 && order[1] == 2);
+
+    ghtv::omx_rpi::load_admission::metrics m = admission.get_metrics();
+    assert(m.queued == 0u && m.peak_queued == 2u && m.blocked == 2u && m.admitted == 5u);
+    assert(m.in_flight_cost == 0u);
+  }
+
+  {
+    // A load larger than the budget is admitted alone
+    ghtv::omx_rpi::load_admission::reservation a(admission, 500u);
+    assert(admission.get_metrics().in_flight_cost == 500u);
+  }
+
+  {
+    // Raising the budget lets the waiting loads in
+    order.clear();
+    ghtv::omx_rpi::load_admission::reservation a(admission, 90u);
+    boost::thread t(boost::bind(&load, boost::ref(admission), 50u, 3));
+    wait_queued(admission, 1u);
+    admission.set_budget(200u);
+    t.join();
+    assert(order.size() == 1u && order[0] == 3);
+  }
+}
@@ -0,0 +1,83 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/mipmap.hpp>
+
+#include <vector>
+#include <cassert>
+
+unsigned char value(unsigned int x, unsigned int y, unsigned int c)
+{
+  return (x * 37u + y * 11u + c * 53u) % 256u;
+}
+
+// Checks box_filter_half against the average of each 2x2 block, the
+// input rows padded past width to check the stride is followed
+void check_level(unsigned int width, unsigned int height, unsigned int bytes)
+{
+  unsigned int stride = width * bytes + 5u;
+  std::vector<unsigned char> in(stride * height, 0xAA);
+  for(unsigned int y = 0; y != height; ++y)
+    for(unsigned int x = 0; x != width; ++x)
+      for(unsigned int c = 0; c != bytes; ++c)
+        in[y * stride + x * bytes + c] = value(x, y, c);
+
+  unsigned int out_width = ghtv::omx_rpi::detail::half_dimension(width)
+    , out_height = ghtv::omx_rpi::detail::half_dimension(height);
+  std::vector<unsigned char> out(out_width * out_height * bytes);
+  ghtv::omx_rpi::detail::box_filter_half(&in[0], stride, width, height, bytes, &out[0]);
+
+  for(unsigned int y = 0; y != out_height; ++y)
+    for(unsigned int x = 0; x != out_width; ++x)
+      for(unsigned int c = 0; c != bytes; ++c)
+      {
+        // A dimension of 1 is repeated, not halved
+        unsigned int x0 = width > 1u ? 2u * x : x, x1 = width > 1u ? x0 + 1u : x0
+          , y0 = height > 1u ? 2u * y : y, y1 = height > 1u ? y0 + 1u : y0;
+        unsigned int sum = value(x0, y0, c) + value(x1, y0, c) + value(x0, y1, c) + value(x1, y1, c);
+        assert(out[(y * out_width + x) * bytes + c] == (sum + 2u) / 4u);
+      }
+}
+
+int main()
+{
+  assert(ghtv::omx_rpi::detail::half_dimension(7u) == 3u);
+  assert(ghtv::omx_rpi::detail::half_dimension(1u) == 1u);
+
+  check_level(16, 8, 4);
+  // Odd dimensions drop their last row or column
+  check_level(15, 9, 4);
+  check_level(7, 1, 4);
+  check_level(1, 6, 4);
+  check_level(9, 5, 1);
+
+  // A flat image stays flat down the chain
+  unsigned int width = 13u, height = 6u;
+  std::vector<unsigned char> level(width * height * 4u, 77), next;
+  while(width > 1u || height > 1u)
+  {
+    unsigned int w = ghtv::omx_rpi::detail::half_dimension(width)
+      , h = ghtv::omx_rpi::detail::half_dimension(height);
+    next.resize(w * h * 4u);
+    ghtv::omx_rpi::detail::box_filter_half(&level[0], width * 4u, width, height, 4u, &next[0]);
+    for(std::size_t i = 0; i != next.size(); ++i)
+      assert(next[i] == 77);
+    level.swap(next);
+    width = w;
+    height = h;
+  }
+  assert(level.size() == 4u);
+}
@@ -0,0 +1,108 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Loads a corrupt copy of an image, which must fail without taking
+// the process down, then the image itself, which must succeed on the
+// recovered pipeline. Needs the Raspberry Pi's OMX components.
+
+#include <bcm_host.h>
+
+#include <ghtv/omx-rpi/image_pipeline.hpp>
+
+#include "egl_pbuffer.hpp"
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cassert>
+
+bool load(ghtv::omx_rpi::image_pipeline& pipeline, std::string const& file, GLuint texture
+          , EGLDisplay& display, EGLContext& context)
+{
+  ghtv::omx_rpi::image_pipeline::load_completion completion;
+  pipeline.load_image(file, texture, &display, &context
+                      , boost::bind(&ghtv::omx_rpi::image_pipeline::load_completion::signal
+                                    , &completion, _1));
+  bool success = completion.wait();
+  pipeline.reset();
+  return success;
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 2)
+  {
+    std::cout << "usage: recovery <image>" << std::endl;
+    return 1;
+  }
+
+  // Keeps the signature, so the decoder is chosen, and scrambles the rest
+  std::vector<char> data;
+  {
+    std::ifstream in(argv[1], std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+  if(data.size() < 64u)
+  {
+    std::cout << "Image too small" << std::endl;
+    return 1;
+  }
+  std::srand(1);
+  for(std::size_t i = 16u; i != data.size(); ++i)
+    data[i] = std::rand();
+  std::string const corrupt = "/tmp/omx-rpi-corrupt-image";
+  {
+    std::ofstream out(corrupt.c_str(), std::ios::binary);
+    out.write(&data[0], data.size());
+  }
+
+  bcm_host_init();
+  std::atexit(bcm_host_deinit);
+
+  EGLDisplay display;
+  EGLContext context;
+  if(!make_pbuffer_current(display, context))
+    return 1;
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+
+  ghtv::omx_rpi::image_pipeline pipeline;
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+  bool corrupt_loaded = load(pipeline, corrupt, texture, display, context);
+  boost::posix_time::ptime recovered = boost::posix_time::microsec_clock::universal_time();
+  bool loaded = load(pipeline, argv[1], texture, display, context);
+
+  std::cout << "corrupt image " << (corrupt_loaded ? "loaded" : "failed")
+            << ", failed and recovered in " << (recovered - start).total_milliseconds()
+            << "ms" << std::endl;
+  std::remove(corrupt.c_str());
+  assert(!corrupt_loaded);
+  // Each step of the recovery waits a deadline of 100ms at most, a
+  // hang would take far longer
+  bool quick = recovered - start < boost::posix_time::seconds(2);
+  assert(quick);
+  assert(loaded);
+  static_cast<void>(quick);
+  return !corrupt_loaded && quick && loaded ? 0 : 1;
+}
@@ -0,0 +1,85 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/rectangle_packer.hpp>
+
+#include <vector>
+#include <cassert>
+#include <cstdlib>
+
+struct rectangle
+{
+  unsigned int x, y, w, h;
+};
+
+bool overlap(rectangle const& a, rectangle const& b)
+{
+  return a.x < b.x + b.w && b.x < a.x + a.w
+    && a.y < b.y + b.h && b.y < a.y + a.h;
+}
+
+int main()
+{
+  {
+    // 256 icons of 64x64 fill a 1024x1024 page without gaps
+    ghtv::omx_rpi::rectangle_packer packer(1024, 1024);
+    for(int i = 0; i != 256; ++i)
+    {
+      unsigned int x, y;
+      bool inserted = packer.insert(64, 64, x, y);
+      assert(inserted && x % 64 == 0 && y % 64 == 0);
+      static_cast<void>(inserted);
+    }
+    unsigned int x, y;
+    bool inserted = packer.insert(1, 1, x, y);
+    assert(!inserted && packer.occupancy() == 1.0f);
+    static_cast<void>(inserted);
+  }
+
+  {
+    // Mixed sizes never overlap and stay inside the page
+    ghtv::omx_rpi::rectangle_packer packer(512, 512);
+    std::vector<rectangle> placed;
+    std::srand(42);
+    for(int i = 0; i != 400; ++i)
+    {
+      rectangle r = {0, 0, 8u + std::rand() % 56, 8u + std::rand() % 56};
+      if(!packer.insert(r.w, r.h, r.x, r.y))
+        continue;
+      assert(r.x + r.w <= 512 && r.y + r.h <= 512);
+      for(std::vector<rectangle>::const_iterator first = placed.begin()
+            , last = placed.end(); first != last; ++first)
+        assert(!overlap(r, *first));
+      placed.push_back(r);
+    }
+    assert(placed.size() > 100);
+    assert(packer.occupancy() > 0.6f);
+
+    packer.clear();
+    unsigned int x, y;
+    bool inserted = packer.insert(512, 512, x, y);
+    assert(inserted && x == 0 && y == 0);
+    static_cast<void>(inserted);
+  }
+
+  {
+    ghtv::omx_rpi::rectangle_packer packer(100, 100);
+    unsigned int x, y;
+    bool too_wide = packer.insert(101, 10, x, y), empty = packer.insert(0, 10, x, y);
+    assert(!too_wide && !empty);
+    static_cast<void>(too_wide); static_cast<void>(empty);
+  }
+}
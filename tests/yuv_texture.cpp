@@ -0,0 +1,90 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <ghtv/omx-rpi/yuv_texture.hpp>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// Values that tell which plane and position they came from
+unsigned char luma(unsigned int x, unsigned int y) { return (x + y * 7u) % 200u; }
+unsigned char u_value(unsigned int x, unsigned int y) { return 200u + (x + y) % 25u; }
+unsigned char v_value(unsigned int x, unsigned int y) { return 225u + (x * 3u + y) % 25u; }
+
+// Decodes a width by height image in slices of slice_height rows, as
+// image_decode lays them out, and checks the packed texture
+void pack(unsigned int width, unsigned int height, unsigned int slice_height)
+{
+  unsigned int stride = (width + 31u) / 32u * 32u;
+  std::vector<unsigned char> slice(stride * slice_height * 3u / 2u);
+  unsigned char* u_plane = &slice[stride * slice_height];
+  unsigned char* v_plane = u_plane + (stride/2) * (slice_height/2);
+
+  ghtv::omx_rpi::decoded_image image;
+  ghtv::omx_rpi::detail::begin_yuv_texture(image, width, height);
+  for(unsigned int first_row = 0; first_row < height; first_row += slice_height)
+  {
+    unsigned int rows = std::min(slice_height, height - first_row);
+    for(unsigned int y = 0; y != rows; ++y)
+      for(unsigned int x = 0; x != width; ++x)
+        slice[y * stride + x] = luma(x, first_row + y);
+    for(unsigned int y = 0; y != (rows + 1u) / 2u; ++y)
+      for(unsigned int x = 0; x != (width + 1u) / 2u; ++x)
+      {
+        u_plane[y * (stride/2) + x] = u_value(x, first_row / 2u + y);
+        v_plane[y * (stride/2) + x] = v_value(x, first_row / 2u + y);
+      }
+    ghtv::omx_rpi::detail::yuv420_slice_to_packed(&slice[0], stride, slice_height, width, height
+                                                  , first_row, rows, image);
+  }
+
+  unsigned int chroma_width = (width + 1u) / 2u, chroma_height = (height + 1u) / 2u;
+  assert(image.format == GL_LUMINANCE);
+  assert(image.width == chroma_width * 2u && image.stride == image.width);
+  assert(image.height == height + chroma_height);
+  for(unsigned int y = 0; y != height; ++y)
+  {
+    for(unsigned int x = 0; x != width; ++x)
+      assert(image.row(y)[x] == luma(x, y));
+    // Odd widths repeat the last column
+    if(width != image.width)
+      assert(image.row(y)[width] == luma(width - 1u, y));
+  }
+  for(unsigned int y = 0; y != chroma_height; ++y)
+    for(unsigned int x = 0; x != chroma_width; ++x)
+    {
+      assert(image.row(height + y)[x] == u_value(x, y));
+      assert(image.row(height + y)[chroma_width + x] == v_value(x, y));
+    }
+
+  // The image's height is found from the texture's, its width is given
+  ghtv::omx_rpi::yuv_texture_layout layout(image.width, image.height, image.format, width);
+  assert(layout.planar);
+  assert(layout.width == width && layout.height == height);
+  assert(layout.luma_height == float(height) / image.height);
+}
+
+int main()
+{
+  pack(64, 48, 16);
+  pack(33, 17, 16);
+  pack(35, 40, 16);
+  pack(8, 7, 8);
+
+  ghtv::omx_rpi::yuv_texture_layout rgba(40, 30, GL_RGBA);
+  assert(!rgba.planar && rgba.width == 40u && rgba.height == 30u && rgba.luma_height == 1.0f);
+}
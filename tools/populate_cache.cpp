@@ -0,0 +1,114 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decodes every PNG and JPEG in a directory into a decoded image
+// cache, so the images are loaded without decoding afterwards.
+//
+//   populate-cache <cache-directory> <image-directory>
+
+#include <bcm_host.h>
+
+#include <ghtv/omx-rpi/image_pipeline.hpp>
+#include <ghtv/omx-rpi/decoded_image_cache.hpp>
+
+#include <boost/bind.hpp>
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cctype>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+bool continue_ = false;
+bool succeeded = false;
+boost::mutex mutex;
+boost::condition_variable condition;
+
+void done_function(bool success)
+{
+  boost::unique_lock<boost::mutex> l(mutex);
+  ::continue_ = true;
+  ::succeeded = success;
+  condition.notify_one();
+}
+
+bool is_image(std::string name)
+{
+  std::string::size_type dot = name.rfind('.');
+  if(dot == std::string::npos)
+    return false;
+  std::string extension = name.substr(dot + 1);
+  for(std::string::iterator first = extension.begin(), last = extension.end()
+        ; first != last; ++first)
+    *first = std::tolower(*first);
+  return extension == "png" || extension == "jpg" || extension == "jpeg";
+}
+
+int main(int argc, char** argv)
+{
+  if(argc != 3)
+  {
+    std::cerr << "Usage: " << argv[0] << " <cache-directory> <image-directory>" << std::endl;
+    return 1;
+  }
+
+  bcm_host_init();
+  std::atexit(bcm_host_deinit);
+
+  ghtv::omx_rpi::decoded_image_cache cache(argv[1]);
+  ghtv::omx_rpi::image_pipeline pipeline;
+  pipeline.set_cache(&cache);
+
+  DIR* directory = ::opendir(argv[2]);
+  if(!directory)
+  {
+    std::cerr << "Couldn't open " << argv[2] << std::endl;
+    return 1;
+  }
+
+  int failures = 0;
+  while(dirent* entry = ::readdir(directory))
+  {
+    std::string path = std::string(argv[2]) + '/' + entry->d_name;
+    struct stat st;
+    if(!is_image(entry->d_name) || ::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+
+    ghtv::omx_rpi::decoded_image image;
+    pipeline.load_image(path, image, &done_function);
+    {
+      boost::unique_lock<boost::mutex> l( ::mutex);
+      while(! ::continue_)
+        ::condition.wait(l);
+
+      ::continue_ = false;
+    }
+    pipeline.reset();
+
+    if(::succeeded)
+      std::cout << path << " " << image.width << "x" << image.height << std::endl;
+    else
+    {
+      std::cerr << "Failed decoding " << path << std::endl;
+      ++failures;
+    }
+  }
+  ::closedir(directory);
+
+  return failures ? 1 : 0;
+}
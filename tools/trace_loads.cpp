@@ -0,0 +1,82 @@
+/* (c) Copyright 2011-2014 Felipe Magno de Almeida
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Decodes images through the CPU output path while recording the OMX
+// components to a trace, or replays a trace recorded on the device
+// loading the same images, and prints how long each load took.
+//
+//   trace-loads record <trace> <image>...
+//   trace-loads replay <trace> <image>...
+//
+// Built with GHTV_OMX_RPI_REPLAY_ONLY it only replays, and needs no
+// OMX libraries.
+
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+#include <bcm_host.h>
+#endif
+
+#include <ghtv/omx-rpi/image_pipeline.hpp>
+#include <ghtv/omx-rpi/omx_trace.hpp>
+
+#include <boost/bind.hpp>
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+
+int main(int argc, char** argv)
+{
+  std::string mode = argc > 1 ? argv[1] : "";
+  if(argc < 4 || (mode != "record" && mode != "replay"))
+  {
+    std::cerr << "Usage: " << argv[0] << " record|replay <trace> <image>..." << std::endl;
+    return 1;
+  }
+
+#ifndef GHTV_OMX_RPI_REPLAY_ONLY
+  bcm_host_init();
+  std::atexit(bcm_host_deinit);
+#endif
+
+  // The pipeline is destroyed first, freeing its components through
+  // the trace before the trace writes its log
+  ghtv::omx_rpi::omx_trace trace(argv[2], mode == "record" ? ghtv::omx_rpi::omx_trace::record
+                                 : ghtv::omx_rpi::omx_trace::replay);
+  ghtv::omx_rpi::image_pipeline pipeline(&trace);
+
+  int failures = 0;
+  for(int i = 3; i != argc; ++i)
+  {
+    ghtv::omx_rpi::decoded_image image;
+    ghtv::omx_rpi::image_pipeline::load_completion completion;
+    boost::uint64_t start = ghtv::omx_rpi::detail::monotonic_microseconds();
+    pipeline.load_image(argv[i], image
+                         , boost::bind(&ghtv::omx_rpi::image_pipeline::load_completion::signal
+                                       , &completion, _1));
+    bool success = completion.wait();
+    pipeline.reset();
+    boost::uint64_t time = ghtv::omx_rpi::detail::monotonic_microseconds() - start;
+
+    if(success)
+      std::cout << argv[i] << " " << time / 1000.0 << "ms" << std::endl;
+    else
+    {
+      std::cerr << "Failed decoding " << argv[i] << std::endl;
+      ++failures;
+    }
+  }
+  return failures ? 1 : 0;
+}